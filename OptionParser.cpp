@@ -8,9 +8,21 @@
 #include "OptionParser.h"
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
 #include <algorithm>
 #include <complex>
+#include <exception>
 #include <ciso646>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <sys/stat.h>
+#ifndef _WIN32
+# include <unistd.h>
+#endif
 
 #if defined(ENABLE_NLS) && ENABLE_NLS
 # include <libintl.h>
@@ -122,15 +134,719 @@ static string basename(const string& s) {
     b.erase(0, i+1);
   return b;
 }
+static bool str_startswith(const string& s, const string& prefix) {
+  return s.compare(0, prefix.length(), prefix) == 0;
+}
+// Levenshtein distance to a fixed pattern of at most 64 characters, with
+// Myers' bit-parallel algorithm: one column of the DP matrix is kept as
+// bit vectors of +1/-1 deltas, so each text character costs a handful of
+// word operations instead of a pass over the pattern.
+class edit_distance {
+public:
+  edit_distance(const string& p) : m(p.length()) {
+    fill(&peq[0], &peq[256], 0);
+    for (size_t i = 0; i < m; ++i)
+      peq[(unsigned char) p[i]] |= uint64_t(1) << i;
+  }
+  size_t operator() (const string& t) const {
+    if (m == 0)
+      return t.length();
+    const uint64_t last = uint64_t(1) << (m - 1);
+    uint64_t pv = ~uint64_t(0), mv = 0;
+    size_t score = m;
+    for (size_t j = 0; j < t.length(); ++j) {
+      uint64_t eq = peq[(unsigned char) t[j]];
+      uint64_t xv = eq | mv;
+      uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+      uint64_t ph = mv | ~(xh | pv);
+      uint64_t mh = pv & xh;
+      if (ph & last)
+        score++;
+      else if (mh & last)
+        score--;
+      // row 0 of the matrix grows by one per column
+      ph = (ph << 1) | 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+    }
+    return score;
+  }
+  const size_t m;
+private:
+  uint64_t peq[256];
+};
+// Calls f(0) .. f(n-1) on up to threads threads (0: one per core), the
+// calling one included; the indexes are handed out in order. If f throws,
+// no more indexes are handed out and the first exception is rethrown once
+// all threads are done.
+template<typename Function>
+static void parallel_for(size_t n, unsigned int threads, Function f) {
+  if (threads == 0)
+    threads = max(thread::hardware_concurrency(), 1u);
+  atomic<size_t> next(0);
+  exception_ptr failure;
+  mutex failure_lock;
+  auto work = [&]() {
+    try {
+      for (size_t i = next++; i < n; i = next++)
+        f(i);
+    } catch (...) {
+      lock_guard<mutex> lock(failure_lock);
+      if (not failure)
+        failure = current_exception();
+      next = n;
+    }
+  };
+  vector<thread> workers;
+  for (size_t t = 1; t < min<size_t>(threads, n); ++t)
+    workers.push_back(thread(work));
+  work();
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  if (failure)
+    rethrow_exception(failure);
+}
+// Parses a comma-separated list with convert(s, &end, x) (strtoll-like,
+// returns false if out of range). Returns the offset of the first bad
+// element, or string::npos.
+template<typename T, typename Convert>
+static size_t parse_list(const char* s, vector<T>& v, Convert convert) {
+  const char* const end = s + strlen(s);
+  if (s == end)
+    return string::npos;
+
+  // counting the delimiters first (memchr is vectorized) sizes the vector once
+  size_t n = 1;
+  for (const char* p = s; (p = static_cast<const char*>(memchr(p, ',', end - p))); ++p)
+    n++;
+  v.reserve(v.size() + n);
+
+  for (const char* p = s; ; ) {
+    char* e;
+    T x;
+    if (not convert(p, &e, x) or e == p or (*e != ',' and *e != '\0'))
+      return p - s;
+    v.push_back(x);
+    if (*e == '\0')
+      return string::npos;
+    p = e + 1;
+  }
+}
+static bool convert_int64(const char* s, char** end, int64_t& x) {
+  errno = 0;
+  x = strtoll(s, end, 10);
+  return errno != ERANGE;
+}
+static bool convert_double(const char* s, char** end, double& x) {
+  errno = 0;
+  x = strtod(s, end);
+  return not (errno == ERANGE and (x == HUGE_VAL or x == -HUGE_VAL));
+}
+// Appends the elements of the list b to the list a, copying a first if
+// it is shared
+template<typename T>
+static void list_extend(shared_ptr<void>& a, const shared_ptr<void>& b) {
+  const T& tail = *static_cast<const T*>(b.get());
+  if (a.use_count() > 1)
+    a = make_shared<T>(*static_cast<const T*>(a.get()));
+  static_cast<T*>(a.get())->insert(static_cast<T*>(a.get())->end(), tail.begin(), tail.end());
+}
+// Reads the digits at p, returns false if there are none; values too large
+// for T (unsigned) become its maximum
+template<typename T>
+static bool parse_uint(const char*& p, T& x) {
+  const T max = static_cast<T>(-1);
+  const char* start = p;
+  for (x = 0; *p >= '0' and *p <= '9'; ++p) {
+    T d = *p - '0';
+    x = (x > (max - d) / 10) ? max : x * 10 + d;
+  }
+  return p != start;
+}
+// Parses a range set like "0-7,16-23:2,32" (numbers, ranges, ranges with a
+// stride) into set, each element below limit and disjoint from the ones
+// before. Returns the offset of the first bad element, or string::npos,
+// and the reason in err.
+static size_t parse_range_set(const char* s, size_t limit, Bitset& set, const char*& err) {
+  for (const char* p = s; ; ++p) {
+    const char* elem = p;
+    size_t first, last, stride = 1;
+    err = _("invalid range");
+    if (not parse_uint(p, first))
+      return elem - s;
+    last = first;
+    if (*p == '-' and not parse_uint(++p, last))
+      return elem - s;
+    if (*p == ':' and (not parse_uint(++p, stride) or stride == 0))
+      return elem - s;
+    if ((*p != ',' and *p != '\0') or last < first)
+      return elem - s;
+
+    err = _("out of range");
+    if (last >= limit)
+      return elem - s;
+    err = _("overlapping range");
+    if (stride == 1) {
+      // no element in first .. last yet
+      size_t next = set.find_next(first == 0 ? Bitset::npos : first - 1);
+      if (next != Bitset::npos and next <= last)
+        return elem - s;
+      set.set(first, last);
+    } else {
+      for (size_t i = first; ; i += stride) {
+        if (set.test(i))
+          return elem - s;
+        set.set(i);
+        if (last - i < stride)
+          break;
+      }
+    }
+    if (*p == '\0')
+      return string::npos;
+  }
+}
+// Reads a decimal number with an optional fraction, as whole + frac/scale
+// (whole is the maximum if too large); returns the end, or 0 if there are
+// no digits
+static const char* parse_decimal(const char* p, uint64_t& whole, uint64_t& frac, uint64_t& scale) {
+  const char* start = p;
+  if (not parse_uint(p, whole) and *p != '.')
+    return 0;
+  frac = 0;
+  scale = 1;
+  if (*p == '.') {
+    // digits beyond what fits are ignored
+    for (++p; *p >= '0' and *p <= '9'; ++p) {
+      if (scale <= UINT64_C(100000000000000000)) {
+        frac = frac * 10 + (*p - '0');
+        scale *= 10;
+      }
+    }
+  }
+  return (p - start > 1 or *start != '.') ? p : 0;
+}
+// out = (whole + frac/scale) * unit, rounded down; false on overflow
+static bool scale_unit(uint64_t whole, uint64_t frac, uint64_t scale, uint64_t unit, uint64_t& out) {
+  const uint64_t max = ~UINT64_C(0);
+  if (whole == max or (unit != 0 and whole > max / unit))
+    return false;
+  out = whole * unit;
+  uint64_t f = (uint64_t) ((long double) frac / scale * unit);
+  if (out > max - f)
+    return false;
+  out += f;
+  return true;
+}
+// Parses a size like "64K", "1.5GiB" or "512MB" into bytes; returns an
+// error message or 0
+static const char* parse_size(const char* s, uint64_t& bytes) {
+  uint64_t whole, frac, scale;
+  const char* p = parse_decimal(s, whole, frac, scale);
+  if (not p)
+    return _("invalid size value");
+
+  uint64_t unit = 1;
+  const char* prefix = strchr("KMGTPE", toupper((unsigned char) *p));
+  if (*p != '\0' and prefix) {
+    bool binary = true;
+    if (p[1] == 'i' and (p[2] == 'B' or p[2] == 'b' or p[2] == '\0')) {
+      p += (p[2] == '\0') ? 2 : 3;
+    } else if (p[1] == 'B' or p[1] == 'b') {
+      binary = false;
+      p += 2;
+    } else {
+      p += 1;
+    }
+    for (const char* k = "KMGTPE"; k <= prefix; ++k)
+      unit *= binary ? 1024 : 1000;
+  } else if (*p == 'B' or *p == 'b') {
+    p++;
+  }
+  if (*p != '\0')
+    return _("invalid size value");
+  if (not scale_unit(whole, frac, scale, unit, bytes))
+    return _("size too large");
+  return 0;
+}
+// Parses a duration like "250ms", "1.5s" or "2h30m" into nanoseconds;
+// returns an error message or 0
+static const char* parse_duration(const char* s, uint64_t& ns) {
+  static const char* const names[] = { "ns", "us", "ms", "s", "m", "h", "d" };
+  static const uint64_t units[] = { 1, UINT64_C(1000), UINT64_C(1000000), UINT64_C(1000000000),
+    UINT64_C(60000000000), UINT64_C(3600000000000), UINT64_C(86400000000000) };
+
+  if (strcmp(s, "0") == 0) {
+    ns = 0;
+    return 0;
+  }
+  ns = 0;
+  const char* p = s;
+  do {
+    uint64_t whole, frac, scale, part;
+    p = parse_decimal(p, whole, frac, scale);
+    if (not p)
+      return _("invalid duration value");
+    const char* name = p;
+    while (*p >= 'a' and *p <= 'z')
+      p++;
+    size_t i = 0;
+    while (i < sizeof(units) / sizeof(units[0]) and string(names[i]) != string(name, p))
+      i++;
+    if (i == sizeof(units) / sizeof(units[0]))
+      return _("invalid duration value");
+    if (not scale_unit(whole, frac, scale, units[i], part) or ns > ~UINT64_C(0) - part)
+      return _("duration too large");
+    ns += part;
+  } while (*p != '\0');
+  return 0;
+}
+enum PathKind { FILE_PATH, DIR_PATH, ANY_PATH };
+// Checks path against the file system, returns the reason it is not
+// acceptable as a path of the given kind, or 0. Thread-safe.
+static const char* path_error(PathKind kind, const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    int e = errno;
+    if (kind == ANY_PATH and e == ENOENT) {
+      // not there yet, but could be created
+      const char* slash = strrchr(path, '/');
+      string dir = slash ? string(path, max<size_t>(slash - path, 1)) : ".";
+      if (stat(dir.c_str(), &st) == 0 and (st.st_mode & S_IFMT) == S_IFDIR)
+        return 0;
+    }
+    if (e == ENOENT or e == ENOTDIR)
+      return _("no such file or directory");
+    if (e == EACCES)
+      return _("permission denied");
+    return _("cannot access");
+  }
+  // S_ISREG()/S_ISDIR() are missing on Windows
+  if (kind == FILE_PATH and (st.st_mode & S_IFMT) != S_IFREG)
+    return _("not a regular file");
+  if (kind == DIR_PATH and (st.st_mode & S_IFMT) != S_IFDIR)
+    return _("not a directory");
+#ifndef _WIN32
+  if ((kind == FILE_PATH and access(path, R_OK) != 0) or
+      (kind == DIR_PATH and access(path, R_OK | X_OK) != 0))
+    return _("permission denied");
+#endif
+  return 0;
+}
+// Checkers of the built-in types, see typeChecker
+// same acceptance as reading with operator>>: a valid prefix is enough,
+// out of range is an error
+static string check_int(const Option&, const string& opt, const char* val, shared_ptr<void>*) {
+  char* end;
+  errno = 0;
+  strtol(val, &end, 10);
+  return (end == val or errno == ERANGE) ? type_error(opt, _("invalid integer value"), val) : "";
+}
+static string check_float(const Option&, const string& opt, const char* val, shared_ptr<void>*) {
+  char* end;
+  errno = 0;
+  double t = strtod(val, &end);
+  return (end == val or (errno == ERANGE and (t == HUGE_VAL or t == -HUGE_VAL))) ?
+    type_error(opt, _("invalid floating-point value"), val) : "";
+}
+static string check_choice(const Option& o, const string& opt, const char* val, shared_ptr<void>*) {
+  if (find(o.choices().begin(), o.choices().end(), val) != o.choices().end())
+    return "";
+  list<string> tmp = o.choices();
+  transform(tmp.begin(), tmp.end(), tmp.begin(), str_wrap("'"));
+  return type_error(opt, _("invalid choice"), val)
+    + " (" + _("choose from") + " " + str_join(", ", tmp.begin(), tmp.end()) + ")";
+}
+// Error for the element at offset bad of a list val
+static string element_error(const string& opt, const char* reason, const char* val, size_t bad) {
+  const char* elem = val + bad;
+  const char* delim = strchr(elem, ',');
+  stringstream err;
+  err << _("option") << " " << opt << ": " << reason << " " << _("at offset") << " " << bad << ": '"
+    << (delim ? string(elem, delim) : string(elem)) << "'";
+  return err.str();
+}
+static string check_int_list(const Option&, const string& opt, const char* val, shared_ptr<void>* obj) {
+  shared_ptr<vector<int64_t> > v = make_shared<vector<int64_t> >();
+  size_t bad = parse_list(val, *v, convert_int64);
+  if (bad != string::npos)
+    return element_error(opt, _("invalid integer value"), val, bad);
+  if (obj)
+    *obj = v;
+  return "";
+}
+static string check_float_list(const Option&, const string& opt, const char* val, shared_ptr<void>* obj) {
+  shared_ptr<vector<double> > v = make_shared<vector<double> >();
+  size_t bad = parse_list(val, *v, convert_double);
+  if (bad != string::npos)
+    return element_error(opt, _("invalid floating-point value"), val, bad);
+  if (obj)
+    *obj = v;
+  return "";
+}
+static string check_range_set(const Option& o, const string& opt, const char* val, shared_ptr<void>* obj) {
+  shared_ptr<Bitset> set = make_shared<Bitset>();
+  const char* reason;
+  size_t bad = parse_range_set(val, o.range_limit(), *set, reason);
+  if (bad != string::npos)
+    return element_error(opt, reason, val, bad);
+  if (obj)
+    *obj = set;
+  return "";
+}
+static string check_size(const Option&, const string& opt, const char* val, shared_ptr<void>* obj) {
+  uint64_t x;
+  const char* reason = parse_size(val, x);
+  if (reason)
+    return type_error(opt, reason, val);
+  if (obj)
+    *obj = make_shared<uint64_t>(x);
+  return "";
+}
+static string check_duration(const Option&, const string& opt, const char* val, shared_ptr<void>* obj) {
+  uint64_t x;
+  const char* reason = parse_duration(val, x);
+  if (reason)
+    return type_error(opt, reason, val);
+  if (obj)
+    *obj = make_shared<uint64_t>(x);
+  return "";
+}
+template<PathKind kind>
+static string check_path(const Option&, const string& opt, const char* val, shared_ptr<void>*) {
+  const char* reason = path_error(kind, val);
+  return reason ? type_error(opt, reason, val) : "";
+}
+static string check_complex(const Option&, const string& opt, const char* val, shared_ptr<void>*) {
+  istringstream ss(val);
+  complex<double> t;
+  return (ss >> t) ? "" : type_error(opt, _("invalid complex value"), val);
+}
+// Appending to a range_set option adds to the set
+static void merge_range_set(shared_ptr<void>& a, const shared_ptr<void>& b) {
+  Bitset set = *static_cast<const Bitset*>(a.get());
+  a = make_shared<Bitset>(set |= *static_cast<const Bitset*>(b.get()));
+}
+// The value of a size option is the plain number of bytes, that of a
+// duration option the number of nanoseconds with unit, so both parse again
+static string format_size(const void* x) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%llu", (unsigned long long) *static_cast<const uint64_t*>(x));
+  return buf;
+}
+static string format_duration(const void* x) {
+  return format_size(x) + "ns";
+}
 ////////// } auxiliary (string) functions //////////
 
 
+////////// class TypeInfo { //////////
+// An option type, see register_type(); the built-in ones also say how
+// appending combines objects and how the object reads as a value
+class TypeInfo {
+  public:
+    TypeInfo(const string& n, const typeChecker& c = typeChecker()) :
+      name(n), check(c), merge(0), format(0), path(false), value(Option::STRING_VALUE) {}
+
+    string name;
+    typeChecker check;
+    //! append: add b to a (copying a first if it is shared), 0 to replace a
+    void (*merge)(shared_ptr<void>& a, const shared_ptr<void>& b);
+    //! the value of the option for its object, 0 to keep the argument
+    string (*format)(const void* obj);
+    //! checked against the file system, after parsing
+    bool path;
+    Option::ValueKind value;
+};
+
+static vector<TypeInfo> builtin_types() {
+  vector<TypeInfo> table;
+  // Option() starts out with id 0
+  table.push_back(TypeInfo("string"));
+  table.push_back(TypeInfo("int", check_int));
+  table.back().value = Option::LONG_VALUE;
+  table.push_back(TypeInfo("long", check_int));
+  table.back().value = Option::LONG_VALUE;
+  table.push_back(TypeInfo("float", check_float));
+  table.back().value = Option::DOUBLE_VALUE;
+  table.push_back(TypeInfo("double", check_float));
+  table.back().value = Option::DOUBLE_VALUE;
+  table.push_back(TypeInfo("choice", check_choice));
+  table.push_back(TypeInfo("int_list", check_int_list));
+  table.back().merge = list_extend<vector<int64_t> >;
+  table.push_back(TypeInfo("float_list", check_float_list));
+  table.back().merge = list_extend<vector<double> >;
+  table.push_back(TypeInfo("range_set", check_range_set));
+  table.back().merge = merge_range_set;
+  table.push_back(TypeInfo("size", check_size));
+  table.back().format = format_size;
+  table.push_back(TypeInfo("duration", check_duration));
+  table.back().format = format_duration;
+  table.push_back(TypeInfo("file", check_path<FILE_PATH>));
+  table.back().path = true;
+  table.push_back(TypeInfo("dir", check_path<DIR_PATH>));
+  table.back().path = true;
+  table.push_back(TypeInfo("path", check_path<ANY_PATH>));
+  table.back().path = true;
+  table.push_back(TypeInfo("complex", check_complex));
+  return table;
+}
+// All types by id, Option::type() looks the id up once
+static vector<TypeInfo>& type_table() {
+  static vector<TypeInfo> table = builtin_types();
+  return table;
+}
+// Id of the type called name; unknown types get an entry without checker,
+// to be filled in if they are registered later
+static size_t type_id(const string& name) {
+  static map<string, size_t> ids;
+  vector<TypeInfo>& table = type_table();
+  for (size_t i = ids.size(); i < table.size(); ++i)
+    ids[table[i].name] = i;
+  map<string, size_t>::const_iterator it = ids.find(name);
+  if (it != ids.end())
+    return it->second;
+  table.push_back(TypeInfo(name));
+  ids[name] = table.size() - 1;
+  return table.size() - 1;
+}
+
+void register_type(const string& name, const typeChecker& check) {
+  TypeInfo& t = type_table()[type_id(name)];
+  t = TypeInfo(name, check);
+}
+string type_error(const string& opt, const string& reason, const char* val) {
+  return _("option") + string(" ") + opt + ": " + reason + ": '" + val + "'";
+}
+////////// } class TypeInfo //////////
+
+
+////////// class ActionInfo { //////////
+// An action, see register_action(); the built-in ones are carried out by
+// OptionParser::process_opt()
+class ActionInfo {
+  public:
+    enum Code { CUSTOM, STORE, STORE_CONST, STORE_TRUE, STORE_FALSE, APPEND, APPEND_CONST,
+      MAP, COUNT, CALLBACK, HELP, VERSION };
+
+    ActionInfo(const string& n, Code c, size_t a = 1, bool t = false, const actionFn& h = actionFn()) :
+      name(n), code(c), nargs(a), typed(t), handle(h) {}
+
+    string name;
+    Code code;
+    size_t nargs;
+    bool typed;
+    actionFn handle;
+};
+
+static vector<ActionInfo> builtin_actions() {
+  vector<ActionInfo> table;
+  // Option() starts out with id 0
+  table.push_back(ActionInfo("store", ActionInfo::STORE, 1, true));
+  table.push_back(ActionInfo("store_const", ActionInfo::STORE_CONST, 0));
+  table.push_back(ActionInfo("store_true", ActionInfo::STORE_TRUE, 0));
+  table.push_back(ActionInfo("store_false", ActionInfo::STORE_FALSE, 0));
+  table.push_back(ActionInfo("append", ActionInfo::APPEND, 1, true));
+  table.push_back(ActionInfo("append_const", ActionInfo::APPEND_CONST, 0));
+  table.push_back(ActionInfo("map", ActionInfo::MAP));
+  table.push_back(ActionInfo("count", ActionInfo::COUNT, 0));
+  table.push_back(ActionInfo("callback", ActionInfo::CALLBACK, 1, true));
+  table.push_back(ActionInfo("help", ActionInfo::HELP, 0));
+  table.push_back(ActionInfo("version", ActionInfo::VERSION, 0));
+  return table;
+}
+// All actions by id, Option::action() looks the id up once
+static vector<ActionInfo>& action_table() {
+  static vector<ActionInfo> table = builtin_actions();
+  return table;
+}
+// Id of the action called name; unknown actions get an entry that does
+// nothing, to be filled in if they are registered later
+static size_t action_id(const string& name) {
+  static map<string, size_t> ids;
+  vector<ActionInfo>& table = action_table();
+  for (size_t i = ids.size(); i < table.size(); ++i)
+    ids[table[i].name] = i;
+  map<string, size_t>::const_iterator it = ids.find(name);
+  if (it != ids.end())
+    return it->second;
+  table.push_back(ActionInfo(name, ActionInfo::CUSTOM));
+  ids[name] = table.size() - 1;
+  return table.size() - 1;
+}
+
+void register_action(const string& name, size_t nargs, const actionFn& handle, bool typed /* = true */) {
+  ActionInfo& a = action_table()[action_id(name)];
+  a = ActionInfo(name, ActionInfo::CUSTOM, nargs, typed, handle);
+}
+////////// } class ActionInfo //////////
+
+
+////////// class ArgvBuffer { //////////
+void ArgvBuffer::push_back(const string& arg) {
+  _offsets.push_back(_buf.size());
+  _buf.insert(_buf.end(), arg.begin(), arg.end());
+  _buf.push_back('\0');
+}
+char* const* ArgvBuffer::argv() const {
+  _argv.resize(_offsets.size() + 1);
+  for (size_t i = 0; i < _offsets.size(); ++i)
+    _argv[i] = const_cast<char*>(&_buf[_offsets[i]]);
+  _argv.back() = 0;
+  return &_argv[0];
+}
+////////// } class ArgvBuffer //////////
+
+
 ////////// class OptionParser { //////////
+class OptionParser::Schema {
+  public:
+    Schema() : _auto_opts(false) {}
+    Schema(const Schema& other);
+    Schema& operator=(const Schema& other) = delete;
+
+    std::list<Option> _opts;
+    optMap _optmap_s;
+    optMap _optmap_l;
+    strMap _defaults;
+    std::list<OptionGroup const*> _groups;
+    //! help/version options have been added
+    bool _auto_opts;
+
+    //! options mentioned in constraints are numbered in order of first
+    //! mention, the rules are masks over these numbers
+    std::map<Option const*, size_t> _ids;
+    std::vector<std::string> _id_names;
+    Bitset _required;
+    std::vector<Bitset> _exclusive;
+    std::vector<Bitset> _at_least_one;
+    //! indexed by id: the options required by that option
+    std::vector<Bitset> _depends;
+};
+
 OptionParser::OptionParser() :
   _usage(_("%prog [options]")),
   _add_help_option(true),
   _add_version_option(true),
-  _interspersed_args(true) {}
+  _interspersed_args(true),
+  _allow_exit(true),
+  _callback_threads(1),
+  _schema(make_shared<Schema>()),
+  _deferring(false) {}
+
+OptionParser::Schema::Schema(const Schema& other) :
+  _opts(other._opts),
+  _optmap_s(other._optmap_s),
+  _optmap_l(other._optmap_l),
+  _defaults(other._defaults),
+  _groups(other._groups),
+  _auto_opts(other._auto_opts),
+  _id_names(other._id_names),
+  _required(other._required),
+  _exclusive(other._exclusive),
+  _at_least_one(other._at_least_one),
+  _depends(other._depends) {
+
+  // entries pointing at options of other now point at our copies, entries
+  // pointing into option groups are kept
+  map<Option const*, Option const*> copies;
+  list<Option>::const_iterator oit = other._opts.begin();
+  for (list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it, ++oit)
+    copies[&*oit] = &*it;
+  optMap* maps[] = { &_optmap_s, &_optmap_l };
+  for (size_t i = 0; i < 2; ++i) {
+    for (optMap::iterator it = maps[i]->begin(); it != maps[i]->end(); ++it) {
+      map<Option const*, Option const*>::const_iterator cit = copies.find(it->second);
+      if (cit != copies.end())
+        it->second = cit->second;
+    }
+  }
+  for (map<Option const*, size_t>::const_iterator it = other._ids.begin(); it != other._ids.end(); ++it) {
+    map<Option const*, Option const*>::const_iterator cit = copies.find(it->first);
+    _ids[(cit != copies.end()) ? cit->second : it->first] = it->second;
+  }
+}
+
+OptionParser::OptionParser(const OptionParser& other, bool share) :
+  _usage(other._usage),
+  _version(other._version),
+  _description(other._description),
+  _add_help_option(other._add_help_option),
+  _add_version_option(other._add_version_option),
+  _prog(other._prog),
+  _epilog(other._epilog),
+  _interspersed_args(other._interspersed_args),
+  _allow_exit(other._allow_exit),
+  _callback_threads(other._callback_threads),
+  // instances start without parse results, copies take them over
+  _values(share ? Values() : other._values),
+  _schema(share ? other._schema : make_shared<Schema>(*other._schema)),
+  _leftover(share ? list<string>() : other._leftover),
+  _seen(share ? Bitset() : other._seen),
+  _appended(share ? appendedMap() : other._appended),
+  _unknown(share ? vector<const char*>() : other._unknown),
+  _unknown_buf(share ? list<string>() : other._unknown_buf),
+  _errors(share ? list<string>() : other._errors),
+  _deferring(false) {
+
+  // redirect pointers into the copied strings
+  list<string>::const_iterator oit = other._unknown_buf.begin();
+  for (list<string>::const_iterator it = _unknown_buf.begin(); it != _unknown_buf.end(); ++it, ++oit)
+    replace(_unknown.begin(), _unknown.end(), oit->c_str(), it->c_str());
+}
+OptionParser::OptionParser(const OptionParser& other) :
+  OptionParser(other, false) {}
+OptionParser& OptionParser::operator=(const OptionParser& other) {
+  if (this != &other)
+    *this = OptionParser(other);
+  return *this;
+}
+
+OptionParser::OptionParser(OptionParser&& other) :
+  OptionParser() {
+  *this = std::move(other);
+}
+OptionParser& OptionParser::operator=(OptionParser&& other) {
+  if (this == &other)
+    return *this;
+  _usage = std::move(other._usage);
+  _version = std::move(other._version);
+  _description = std::move(other._description);
+  _add_help_option = other._add_help_option;
+  _add_version_option = other._add_version_option;
+  _prog = std::move(other._prog);
+  _epilog = std::move(other._epilog);
+  _interspersed_args = other._interspersed_args;
+  _allow_exit = other._allow_exit;
+  _callback_threads = other._callback_threads;
+  _values = std::move(other._values);
+  _schema = std::move(other._schema);
+  _leftover = std::move(other._leftover);
+  _seen = std::move(other._seen);
+  _appended = std::move(other._appended);
+  _unknown = std::move(other._unknown);
+  _unknown_buf = std::move(other._unknown_buf);
+  _errors = std::move(other._errors);
+  _deferred = std::move(other._deferred);
+  _deferring = other._deferring;
+  // leave other usable
+  other._schema = make_shared<Schema>();
+  return *this;
+}
+
+OptionParser::Schema& OptionParser::detach() {
+  if (_schema.use_count() > 1)
+    _schema = make_shared<Schema>(*_schema);
+  return *_schema;
+}
+OptionParser OptionParser::instance() {
+  add_default_options();
+  return OptionParser(*this, true);
+}
+OptionParser& OptionParser::set_defaults(const string& dest, const string& val) {
+  detach()._defaults[dest] = val;
+  return *this;
+}
 
 Option& OptionParser::add_option(const string& opt) {
   const string tmp[1] = { opt };
@@ -145,8 +861,9 @@ Option& OptionParser::add_option(const string& opt1, const string& opt2, const s
   return add_option(vector<string>(&tmp[0], &tmp[3]));
 }
 Option& OptionParser::add_option(const vector<string>& v) {
-  _opts.resize(_opts.size()+1);
-  Option& option = _opts.back();
+  Schema& schema = detach();
+  schema._opts.resize(schema._opts.size()+1);
+  Option& option = schema._opts.back();
   string dest_fallback;
   for (vector<string>::const_iterator it = v.begin(); it != v.end(); ++it) {
     if (it->substr(0,2) == "--") {
@@ -154,13 +871,13 @@ Option& OptionParser::add_option(const vector<string>& v) {
       if (option.dest() == "")
         option.dest(str_replace(s, "-", "_"));
       option._long_opts.insert(s);
-      _optmap_l[s] = &option;
+      schema._optmap_l[s] = &option;
     } else {
       const string s = it->substr(1,1);
       if (dest_fallback == "")
         dest_fallback = s;
       option._short_opts.insert(s);
-      _optmap_s[s] = &option;
+      schema._optmap_s[s] = &option;
     }
   }
   if (option.dest() == "")
@@ -169,202 +886,907 @@ Option& OptionParser::add_option(const vector<string>& v) {
 }
 
 OptionParser& OptionParser::add_option_group(const OptionGroup& group) {
-  for (list<Option>::const_iterator oit = group._opts.begin(); oit != group._opts.end(); ++oit) {
+  Schema& schema = detach();
+  for (list<Option>::const_iterator oit = group._schema->_opts.begin(); oit != group._schema->_opts.end(); ++oit) {
     const Option& option = *oit;
     for (set<string>::const_iterator it = option._short_opts.begin(); it != option._short_opts.end(); ++it)
-      _optmap_s[*it] = &option;
+      schema._optmap_s[*it] = &option;
     for (set<string>::const_iterator it = option._long_opts.begin(); it != option._long_opts.end(); ++it)
-      _optmap_l[*it] = &option;
+      schema._optmap_l[*it] = &option;
   }
-  _groups.push_back(&group);
+  schema._groups.push_back(&group);
   return *this;
 }
 
-const Option& OptionParser::lookup_short_opt(const string& opt) const {
-  optMap::const_iterator it = _optmap_s.find(opt);
-  if (it == _optmap_s.end())
-    error(_("no such option") + string(": -") + opt);
-  return *it->second;
+const Option* OptionParser::find_opt(const string& opt) const {
+  string err;
+  return str_startswith(opt, "--") ? lookup_long_opt(opt.substr(2), err, false) :
+                                     lookup_short_opt(opt.substr(1, 1), err);
+}
+size_t OptionParser::constraint_id(const string& opt) {
+  // detach first: the lookup must return the option of the schema we modify
+  Schema& schema = detach();
+  const Option* o = find_opt(opt);
+  if (not o)
+    return Bitset::npos;
+  map<Option const*, size_t>::const_iterator it = schema._ids.find(o);
+  if (it != schema._ids.end())
+    return it->second;
+  schema._ids[o] = schema._id_names.size();
+  schema._id_names.push_back(opt);
+  return schema._id_names.size() - 1;
+}
+Bitset OptionParser::constraint_mask(const vector<string>& v) {
+  Bitset mask;
+  for (vector<string>::const_iterator it = v.begin(); it != v.end(); ++it) {
+    size_t id = constraint_id(*it);
+    if (id != Bitset::npos)
+      mask.set(id);
+  }
+  return mask;
+}
+string OptionParser::constraint_names(const Bitset& mask) const {
+  list<string> names;
+  for (size_t i = mask.find_next(); i != Bitset::npos; i = mask.find_next(i))
+    names.push_back(_schema->_id_names[i]);
+  return str_join(", ", names.begin(), names.end());
 }
 
-void OptionParser::handle_short_opt(const string& opt, const string& arg) {
+OptionParser& OptionParser::required(const string& opt) {
+  size_t id = constraint_id(opt);
+  if (id != Bitset::npos)
+    detach()._required.set(id);
+  return *this;
+}
+OptionParser& OptionParser::mutually_exclusive(const string& opt1, const string& opt2) {
+  const string tmp[2] = { opt1, opt2 };
+  return mutually_exclusive(vector<string>(&tmp[0], &tmp[2]));
+}
+OptionParser& OptionParser::mutually_exclusive(const string& opt1, const string& opt2, const string& opt3) {
+  const string tmp[3] = { opt1, opt2, opt3 };
+  return mutually_exclusive(vector<string>(&tmp[0], &tmp[3]));
+}
+OptionParser& OptionParser::mutually_exclusive(const vector<string>& v) {
+  Bitset mask = constraint_mask(v);
+  detach()._exclusive.push_back(mask);
+  return *this;
+}
+OptionParser& OptionParser::at_least_one_of(const string& opt1, const string& opt2) {
+  const string tmp[2] = { opt1, opt2 };
+  return at_least_one_of(vector<string>(&tmp[0], &tmp[2]));
+}
+OptionParser& OptionParser::at_least_one_of(const string& opt1, const string& opt2, const string& opt3) {
+  const string tmp[3] = { opt1, opt2, opt3 };
+  return at_least_one_of(vector<string>(&tmp[0], &tmp[3]));
+}
+OptionParser& OptionParser::at_least_one_of(const vector<string>& v) {
+  Bitset mask = constraint_mask(v);
+  if (mask.any())
+    detach()._at_least_one.push_back(mask);
+  return *this;
+}
+OptionParser& OptionParser::depends(const string& opt, const string& other) {
+  size_t id = constraint_id(opt), dep = constraint_id(other);
+  if (id == Bitset::npos or dep == Bitset::npos)
+    return *this;
+  Schema& schema = detach();
+  if (schema._depends.size() <= id)
+    schema._depends.resize(id + 1);
+  schema._depends[id].set(dep);
+  return *this;
+}
 
-  _remaining.pop_front();
-  string value;
+void OptionParser::check_constraints() const {
+  const Schema& schema = *_schema;
 
-  const Option& option = lookup_short_opt(opt);
-  if (option._nargs == 1) {
-    value = arg.substr(2);
-    if (value == "") {
-      if (_remaining.empty())
-        error("-" + opt + " " + _("option requires an argument"));
-      value = _remaining.front();
-      _remaining.pop_front();
+  if (not _seen.contains(schema._required)) {
+    Bitset missing;
+    for (size_t i = schema._required.find_next(); i != Bitset::npos; i = schema._required.find_next(i)) {
+      if (not _seen.test(i))
+        missing.set(i);
     }
-  } else {
-    if (arg.length() > 2)
-      _remaining.push_front(string("-") + arg.substr(2));
+    error(_("missing required option") + string(": ") + constraint_names(missing));
+  }
+  for (vector<Bitset>::const_iterator it = schema._exclusive.begin(); it != schema._exclusive.end(); ++it) {
+    size_t first = Bitset::npos, second = Bitset::npos;
+    for (size_t i = it->find_next(); i != Bitset::npos and second == Bitset::npos; i = it->find_next(i)) {
+      if (_seen.test(i))
+        (first == Bitset::npos ? first : second) = i;
+    }
+    if (second != Bitset::npos)
+      error(_("option") + string(" ") + schema._id_names[second] + ": " + _("not allowed with option") + " " +
+          schema._id_names[first]);
   }
+  for (vector<Bitset>::const_iterator it = schema._at_least_one.begin(); it != schema._at_least_one.end(); ++it) {
+    if (not _seen.intersects(*it))
+      error(_("one of these options is required") + string(": ") + constraint_names(*it));
+  }
+  for (size_t i = _seen.find_next(); i != Bitset::npos and i < schema._depends.size(); i = _seen.find_next(i)) {
+    const Bitset& deps = schema._depends[i];
+    if (_seen.contains(deps))
+      continue;
+    for (size_t j = deps.find_next(); j != Bitset::npos; j = deps.find_next(j)) {
+      if (not _seen.test(j))
+        error(_("option") + string(" ") + schema._id_names[i] + ": " + _("requires option") + " " +
+            schema._id_names[j]);
+    }
+  }
+}
 
-  process_opt(option, string("-") + opt, value);
+const Option* OptionParser::lookup_short_opt(const string& opt, string& err) const {
+  optMap::const_iterator it = _schema->_optmap_s.find(opt);
+  if (it == _schema->_optmap_s.end()) {
+    err = _("no such option") + string(": -") + opt;
+    return 0;
+  }
+  return it->second;
 }
 
-const Option& OptionParser::lookup_long_opt(const string& opt) const {
+const Option* OptionParser::lookup_long_opt(const string& opt, string& err, bool abbrev,
+    bool* unknown, bool suggest) const {
 
-  list<string> matching;
-  for (optMap::const_iterator it = _optmap_l.begin(); it != _optmap_l.end(); ++it) {
-    if (it->first.compare(0, opt.length(), opt) == 0)
+  // the names starting with opt form one contiguous range of the map
+  const optMap& m = _schema->_optmap_l;
+  optMap::const_iterator begin = m.lower_bound(opt), end = begin;
+  size_t n = 0;
+  for (; end != m.end() and str_startswith(end->first, opt); ++end)
+    n++;
+  if (not abbrev)
+    n = (begin != m.end() and begin->first == opt) ? 1 : 0;
+  if (n > 1) {
+    list<string> matching;
+    for (optMap::const_iterator it = begin; it != end; ++it)
       matching.push_back(it->first);
-  }
-  if (matching.size() > 1) {
     string x = str_join(", ", matching.begin(), matching.end());
-    error(_("ambiguous option") + string(": --") + opt + " (" + x + "?)");
+    err = _("ambiguous option") + string(": --") + opt + " (" + x + "?)";
+    return 0;
+  }
+  if (n == 0) {
+    err = _("no such option") + string(": --") + opt;
+    if (suggest)
+      err += suggest_long_opt(opt);
+    if (unknown)
+      *unknown = true;
+    return 0;
   }
-  if (matching.size() == 0)
-    error(_("no such option") + string(": --") + opt);
 
-  return *_optmap_l.find(matching.front())->second;
+  return begin->second;
 }
 
-void OptionParser::handle_long_opt(const string& optstr) {
-
-  _remaining.pop_front();
-  string opt, value;
+string OptionParser::suggest_long_opt(const string& opt) const {
+  if (opt.length() > 64)
+    return "";
 
-  size_t delim = optstr.find("=");
-  if (delim != string::npos) {
-    opt = optstr.substr(0, delim);
-    value = optstr.substr(delim+1);
-  } else
-    opt = optstr;
-
-  const Option& option = lookup_long_opt(opt);
-  if (option._nargs == 1 and delim == string::npos) {
-    if (not _remaining.empty()) {
-      value = _remaining.front();
-      _remaining.pop_front();
+  // only names within a few edits are worth suggesting, and the length
+  // difference alone rules out most of them
+  const edit_distance dist(opt);
+  size_t best = 1 + opt.length() / 4;
+  list<string> matching;
+  for (optMap::const_iterator it = _schema->_optmap_l.begin(); it != _schema->_optmap_l.end(); ++it) {
+    size_t len = it->first.length();
+    if ((len > opt.length() ? len - opt.length() : opt.length() - len) > best or
+        it->second->help() == SUPPRESS_HELP)
+      continue;
+    size_t d = dist(it->first);
+    if (d < best)
+      matching.clear();
+    if (d <= best) {
+      best = d;
+      if (matching.size() < 3)
+        matching.push_back("--" + it->first);
     }
   }
-
-  if (option._nargs == 1 and value == "")
-    error("--" + opt + " " + _("option requires an argument"));
-
-  process_opt(option, string("--") + opt, value);
+  if (matching.empty())
+    return "";
+  return " (" + string(_("did you mean")) + " " + str_join(", ", matching.begin(), matching.end()) + "?)";
 }
 
 Values& OptionParser::parse_args(const int argc, char const* const* const argv) {
   if (prog() == "")
     prog(basename(argv[0]));
-  return parse_args(&argv[1], &argv[argc]);
+  handle_completion(argc, argv);
+  ParseStream stream(*this, &argv[1], &argv[argc]);
+  return parse_tokens(stream, false);
 }
 Values& OptionParser::parse_args(const vector<string>& v) {
-
-  _remaining.assign(v.begin(), v.end());
-
-  if (add_version_option() and version() != "") {
-    add_option("--version") .action("version") .help(_("show program's version number and exit"));
-    _opts.splice(_opts.begin(), _opts, --(_opts.end()));
+  shared_ptr<const string> args = copy_args(v);
+  ParseStream stream(*this, args->data(), args->size());
+  return parse_tokens(stream, false, args);
+}
+Values& OptionParser::parse_args(const char* buf, size_t len) {
+  if (len == 0)
+    return parse_args(vector<string>());
+  if (prog() == "")
+    prog(basename(buf));
+  size_t n = strlen(buf) + 1;
+  ParseStream stream(*this, buf + n, len - min(n, len));
+  return parse_tokens(stream, false);
+}
+Values& OptionParser::parse_known_args(const int argc, char const* const* const argv) {
+  if (prog() == "")
+    prog(basename(argv[0]));
+  handle_completion(argc, argv);
+  ParseStream stream(*this, &argv[1], &argv[argc]);
+  return parse_tokens(stream, true);
+}
+Values& OptionParser::parse_known_args(const vector<string>& v) {
+  shared_ptr<const string> args = copy_args(v);
+  ParseStream stream(*this, args->data(), args->size());
+  return parse_tokens(stream, true, args);
+}
+Values& OptionParser::parse_known_args(const char* buf, size_t len) {
+  if (len == 0)
+    return parse_known_args(vector<string>());
+  if (prog() == "")
+    prog(basename(buf));
+  size_t n = strlen(buf) + 1;
+  ParseStream stream(*this, buf + n, len - min(n, len));
+  return parse_tokens(stream, true);
+}
+// The arguments NUL-separated in one buffer, for the Values to point into
+shared_ptr<const string> OptionParser::copy_args(const vector<string>& v) const {
+  size_t n = 0;
+  for (size_t i = 0; i < v.size(); ++i)
+    n += v[i].size() + 1;
+  shared_ptr<string> buf = make_shared<string>();
+  buf->reserve(n);
+  for (size_t i = 0; i < v.size(); ++i)
+    buf->append(v[i].c_str(), v[i].size() + 1);
+  return buf;
+}
+// Drops what points into the previous arguments; args keeps the new ones
+// alive if they are a copy
+void OptionParser::start_parse(const shared_ptr<const string>& args) {
+  _values._argvMap.clear();
+  // the entries of map options point into the arguments as well
+  list<Option const*> opts;
+  for (list<Option>::const_iterator it = _schema->_opts.begin(); it != _schema->_opts.end(); ++it)
+    opts.push_back(&*it);
+  for (list<OptionGroup const*>::const_iterator git = _schema->_groups.begin(); git != _schema->_groups.end(); ++git) {
+    for (list<Option>::const_iterator it = (*git)->_schema->_opts.begin(); it != (*git)->_schema->_opts.end(); ++it)
+      opts.push_back(&*it);
   }
-  if (add_help_option()) {
-    add_option("-h", "--help") .action("help") .help(_("show this help message and exit"));
-    _opts.splice(_opts.begin(), _opts, --(_opts.end()));
+  for (list<Option const*>::const_iterator it = opts.begin(); it != opts.end(); ++it) {
+    if ((*it)->action_info().code == ActionInfo::MAP)
+      _values._objMap.erase((*it)->dest());
   }
+  _values._args = args;
+  _seen = Bitset();
+  _appended.clear();
+  _unknown.clear();
+  _unknown_buf.clear();
+}
+Values& OptionParser::parse_tokens(ParseStream& stream, bool known,
+    const shared_ptr<const string>& args /* = shared_ptr<const string>() */) {
+  start_parse(args);
 
-  while (not _remaining.empty()) {
-    const string arg = _remaining.front();
-
-    if (arg == "--") {
-      _remaining.pop_front();
-      break;
-    }
-
-    if (arg.substr(0,2) == "--") {
-      handle_long_opt(arg.substr(2));
-    } else if (arg.substr(0,1) == "-" and arg.length() > 1) {
-      handle_short_opt(arg.substr(1,1), arg);
+  const map<Option const*, size_t>& ids = _schema->_ids;
+  // file system checks are collected and done all at once
+  vector<OptArg> paths;
+  stream.check_paths(false);
+  // unknown options are no error for parse_known_args()
+  stream.suggest(not known);
+  ParseEvent ev;
+  while (stream.next(ev)) {
+    if (ev.kind == ParseEvent::OPTION) {
+      for (size_t i = 0; i < ev.nvalues and ev.option->type_info().path; ++i) {
+        OptArg path = { ev.option, ev.opt, ev.values[i] };
+        paths.push_back(path);
+      }
+      if (not ids.empty()) {
+        map<Option const*, size_t>::const_iterator it = ids.find(ev.option);
+        if (it != ids.end())
+          _seen.set(it->second);
+      }
+      process_opt(ev);
+    } else if (ev.kind == ParseEvent::POSITIONAL) {
+      _leftover.push_back(ev.value);
+    } else if (ev.kind == ParseEvent::UNKNOWN and known) {
+      add_unknown(stream, ev.value);
     } else {
-      _remaining.pop_front();
-      _leftover.push_back(arg);
-      if (not interspersed_args())
-        break;
+      error(ev.error);
     }
   }
-  while (not _remaining.empty()) {
-    const string arg = _remaining.front();
-    _remaining.pop_front();
-    _leftover.push_back(arg);
+  check_path_args(paths);
+  check_constraints();
+
+  store_appended();
+  set_default_values();
+  run_deferred();
+  return _values;
+}
+Values& OptionParser::prescan_args(const int argc, char const* const* const argv) {
+  if (prog() == "")
+    prog(basename(argv[0]));
+
+  start_parse(shared_ptr<const string>());
+  ParseStream stream(*this, &argv[1], &argv[argc]);
+  stream.allow_abbrev(false).suggest(false);
+  ParseEvent ev;
+  while (not stream.options_done() and stream.next(ev)) {
+    if (ev.kind != ParseEvent::OPTION)
+      continue;
+    ActionInfo::Code c = ev.option->action_info().code;
+    if (c != ActionInfo::HELP and c != ActionInfo::VERSION and c != ActionInfo::CALLBACK)
+      process_opt(ev);
   }
 
-  for (strMap::const_iterator it = _defaults.begin(); it != _defaults.end(); ++it) {
+  store_appended();
+  return set_default_values();
+}
+Values& OptionParser::set_default_values() {
+  for (strMap::const_iterator it = _schema->_defaults.begin(); it != _schema->_defaults.end(); ++it) {
     if (not _values.is_set(it->first))
       _values[it->first] = it->second;
   }
 
-  for (list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it) {
-    if (it->get_default() != "" and not _values.is_set(it->dest()))
+  for (list<Option>::const_iterator it = _schema->_opts.begin(); it != _schema->_opts.end(); ++it) {
+    if (it->get_default() != "" and not _values.is_set(it->dest())) {
         _values[it->dest()] = it->get_default();
+        shared_ptr<void> obj;
+        it->check_type("", it->get_default().c_str(), &obj);
+        if (obj)
+          store_object(*it, obj);
+    }
   }
 
   return _values;
 }
 
-void OptionParser::process_opt(const Option& o, const string& opt, const string& value) {
-  if (o.action() == "store") {
-    string err = o.check_type(opt, value);
-    if (err != "")
-      error(err);
-    _values[o.dest()] = value;
-    _values.is_set_by_user(o.dest(), true);
+void OptionParser::store_appended() {
+  list<Option const*> opts;
+  for (list<Option>::const_iterator it = _schema->_opts.begin(); it != _schema->_opts.end(); ++it)
+    opts.push_back(&*it);
+  for (list<OptionGroup const*>::const_iterator git = _schema->_groups.begin(); git != _schema->_groups.end(); ++git) {
+    for (list<Option>::const_iterator it = (*git)->_schema->_opts.begin(); it != (*git)->_schema->_opts.end(); ++it)
+      opts.push_back(&*it);
+  }
+
+  // each appended value is copied once, after parsing
+  set<string> done;
+  for (list<Option const*>::const_iterator it = opts.begin(); it != opts.end(); ++it) {
+    const Option& o = **it;
+    ActionInfo::Code c = o.action_info().code;
+    const refMap* m = (c == ActionInfo::MAP) ? _values.as<refMap>(o.dest()) : 0;
+    if (m) {
+      char buf[24];
+      snprintf(buf, sizeof(buf), "%lu", (unsigned long) m->size());
+      _values[o.dest()] = buf;
+      continue;
+    }
+    if (not ((c == ActionInfo::APPEND and o.nargs() == 1) or c == ActionInfo::APPEND_CONST) or
+        not done.insert(o.dest()).second)
+      continue;
+    const vector<const char*>& v = const_cast<const Values&>(_values).argv(o.dest());
+    if (v.empty())
+      continue;
+    _values.all(o.dest()).assign(v.begin(), v.end());
+    _values[o.dest()] = v.back();
+  }
+}
+
+void OptionParser::add_unknown(ParseStream& stream, const char* arg) {
+  if (arg[0] != '-') {
+    // found in the middle of a group of short options
+    _unknown_buf.push_back("-" + string(arg));
+    _unknown.push_back(_unknown_buf.back().c_str());
+    return;
+  }
+  _unknown.push_back(arg);
+
+  // guess whether the option takes the next argument: "--opt" and "-o"
+  // might, "--opt=val" and "-oval" cannot
+  bool inline_val = (arg[1] == '-') ? strchr(arg, '=') != 0 : arg[2] != '\0';
+  const char* val = inline_val ? 0 : stream.take_value();
+  if (val)
+    _unknown.push_back(val);
+}
+
+void OptionParser::add_default_options() {
+  if (_schema->_auto_opts)
+    return;
+  Schema& schema = detach();
+  schema._auto_opts = true;
+  if (add_version_option() and version() != "") {
+    add_option("--version") .action("version") .help(_("show program's version number and exit"));
+    schema._opts.splice(schema._opts.begin(), schema._opts, --(schema._opts.end()));
+  }
+  if (add_help_option()) {
+    add_option("-h", "--help") .action("help") .help(_("show this help message and exit"));
+    schema._opts.splice(schema._opts.begin(), schema._opts, --(schema._opts.end()));
   }
-  else if (o.action() == "store_const") {
+}
+
+void OptionParser::process_opt(const ParseEvent& ev) {
+  const Option& o = *ev.option;
+  const ActionInfo& action = o.action_info();
+  const string& opt = ev.opt;
+  const char* value = ev.value;
+  switch (action.code) {
+  case ActionInfo::APPEND:
+    if (o.nargs() == 1) {
+      // the list in all(dest) and the value are filled in by store_appended()
+      if (not o.dedupe() or _appended[o.dest()].insert(value).second)
+        _values.argv(o.dest()).push_back(value);
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    }
+    // fall through
+  case ActionInfo::STORE:
+    if (o.nargs() > 1) {
+      vector<const char*>& v = _values.argv(o.dest());
+      if (action.code == ActionInfo::STORE)
+        v.clear();
+      v.insert(v.end(), ev.values, ev.values + ev.nvalues);
+      ostringstream n;
+      n << v.size();
+      _values[o.dest()] = n.str();
+      _values.is_set_by_user(o.dest(), true);
+    }
+    else if (action.code == ActionInfo::STORE) {
+      _values[o.dest()] = value;
+      _values.is_set_by_user(o.dest(), true);
+    }
+    break;
+  case ActionInfo::APPEND_CONST:
+    if (not o.dedupe() or _appended[o.dest()].insert(o.get_const().c_str()).second)
+      _values.argv(o.dest()).push_back(o.get_const().c_str());
+    _values.is_set_by_user(o.dest(), true);
+    break;
+  case ActionInfo::STORE_CONST:
     _values[o.dest()] = o.get_const();
     _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "store_true") {
+    break;
+  case ActionInfo::STORE_TRUE:
     _values[o.dest()] = "1";
     _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "store_false") {
+    break;
+  case ActionInfo::STORE_FALSE:
     _values[o.dest()] = "0";
     _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "append") {
-    string err = o.check_type(opt, value);
-    if (err != "")
-      error(err);
-    _values[o.dest()] = value;
-    _values.all(o.dest()).push_back(value);
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "append_const") {
-    _values[o.dest()] = o.get_const();
-    _values.all(o.dest()).push_back(o.get_const());
+    break;
+  case ActionInfo::MAP: {
+    // split on the first '=', the name is referenced in place
+    shared_ptr<void>& obj = _values.object(o.dest());
+    if (not obj)
+      obj = make_shared<refMap>();
+    else if (obj.use_count() > 1)
+      obj = make_shared<refMap>(*static_cast<const refMap*>(obj.get()));
+    refMap& m = *static_cast<refMap*>(obj.get());
+    const char* eq = strchr(value, '=');
+    StrRef name(value, eq ? eq - value : strlen(value));
+    const char* val = eq ? eq + 1 : value + name.size;
+    pair<refMap::iterator, bool> entry = m.insert(make_pair(name, val));
+    if (not entry.second and o.unique_keys())
+      error(_("option") + string(" ") + opt + ": " + _("duplicate name") + ": '" + name.str() + "'");
+    else {
+      entry.first->second = val;
+      _values.argv(o.dest()).push_back(value);
+    }
     _values.is_set_by_user(o.dest(), true);
+    break;
   }
-  else if (o.action() == "count") {
+  case ActionInfo::COUNT:
     _values[o.dest()] = str_inc(_values[o.dest()]);
     _values.is_set_by_user(o.dest(), true);
+    break;
+  case ActionInfo::HELP:
+    if (allow_exit()) {
+      print_help();
+      std::exit(0);
+    }
+    break;
+  case ActionInfo::VERSION:
+    if (allow_exit()) {
+      print_version();
+      std::exit(0);
+    }
+    break;
+  case ActionInfo::CALLBACK:
+    // options taking more than one argument call back once per argument
+    for (size_t i = 0; i < max<size_t>(ev.nvalues, 1); ++i) {
+      const char* v = (ev.nvalues > 0) ? ev.values[i] : value;
+      if (o._defer) {
+        OptArg call = { &o, opt, v };
+        _deferred.push_back(call);
+      } else {
+        call_callback(o, opt, v);
+      }
+    }
+    break;
+  case ActionInfo::CUSTOM:
+    if (action.handle)
+      action.handle(ev, _values, *this);
+    break;
   }
-  else if (o.action() == "help") {
-    print_help();
-    std::exit(0);
+
+  if (ev.object and (action.code == ActionInfo::STORE or action.code == ActionInfo::APPEND))
+    store_object(o, ev.object);
+}
+
+void OptionParser::store_object(const Option& o, const shared_ptr<void>& obj) {
+  // objects built by a factory are the user's, whatever the type is called
+  const TypeInfo* t = o.factory() ? 0 : &o.type_info();
+  if (t and t->format)
+    _values[o.dest()] = t->format(obj.get());
+
+  shared_ptr<void>& cur = _values.object(o.dest());
+  if (o.action_info().code == ActionInfo::STORE or not cur or not t or not t->merge)
+    cur = obj;
+  else
+    t->merge(cur, obj);
+}
+
+void OptionParser::call_callback(const Option& o, const string& opt, const char* value) {
+  if (o._callback_fn)
+    o._callback_fn(o, opt, value, *this);
+  else if (o.callback())
+    (*o.callback())(o, opt, value, *this);
+}
+
+size_t OptionParser::callback_level(const Option* o, map<Option const*, size_t>& levels) const {
+  map<Option const*, size_t>::iterator it = levels.find(o);
+  if (it == levels.end() or it->second != Bitset::npos)
+    return (it == levels.end()) ? Bitset::npos : it->second;
+
+  // marked as level 0 while its dependencies are visited, which breaks cycles
+  it->second = 0;
+  size_t level = 0;
+  for (list<string>::const_iterator ait = o->after().begin(); ait != o->after().end(); ++ait) {
+    size_t l = callback_level(find_opt(*ait), levels);
+    if (l != Bitset::npos)
+      level = max(level, l + 1);
+  }
+  levels[o] = level;
+  return level;
+}
+
+void OptionParser::run_deferred() {
+  if (_deferred.empty())
+    return;
+  vector<OptArg> calls;
+  calls.swap(_deferred);
+
+  // one task per option, running its calls in order; a task's level is
+  // one more than the highest level it runs after, and the tasks of one
+  // level run in parallel once the previous level is done
+  map<Option const*, size_t> levels;
+  vector<const Option*> tasks;
+  for (size_t i = 0; i < calls.size(); ++i) {
+    if (levels.insert(make_pair(calls[i].option, Bitset::npos)).second)
+      tasks.push_back(calls[i].option);
   }
-  else if (o.action() == "version") {
-    print_version();
-    std::exit(0);
+  vector<vector<const Option*> > by_level;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    size_t l = callback_level(tasks[i], levels);
+    if (by_level.size() <= l)
+      by_level.resize(l + 1);
+    by_level[l].push_back(tasks[i]);
   }
-  else if (o.action() == "callback" && o.callback()) {
-    (*o.callback())(o, opt, value, *this);
+
+  // errors are collected while the callbacks run, and reported after
+  size_t before = _errors.size();
+  _deferring = true;
+  try {
+    for (size_t l = 0; l < by_level.size(); ++l) {
+      const vector<const Option*>& level = by_level[l];
+      parallel_for(level.size(), callback_threads(), [&](size_t t) {
+        for (size_t i = 0; i < calls.size(); ++i) {
+          if (calls[i].option == level[t])
+            call_callback(*calls[i].option, calls[i].opt, calls[i].value);
+        }
+      });
+    }
+  } catch (...) {
+    _deferring = false;
+    throw;
+  }
+  _deferring = false;
+
+  if (allow_exit() and _errors.size() > before) {
+    list<string>::iterator it = _errors.begin();
+    advance(it, before);
+    string msg = *it;
+    _errors.erase(it, _errors.end());
+    error(msg);
   }
 }
 
+void OptionParser::check_path_args(const vector<OptArg>& args) {
+  // a few stat() calls are cheaper than starting threads
+  vector<string> errors(args.size());
+  parallel_for(args.size(), (args.size() < 16) ? 1 : 0, [&](size_t i) {
+    errors[i] = args[i].option->check_type(args[i].opt, args[i].value);
+  });
+  for (size_t i = 0; i < errors.size(); ++i) {
+    if (errors[i] != "")
+      error(errors[i]);
+  }
+}
+
+void OptionParser::handle_completion(const int argc, char const* const* const argv) {
+  const char* s = getenv("OPTPARSE_COMPLETE");
+  if (not s or not allow_exit())
+    return;
+  add_default_options();
+  vector<string> words = complete(argc, argv, atoi(s));
+  for (vector<string>::const_iterator it = words.begin(); it != words.end(); ++it)
+    cout << *it << "\n";
+  cout.flush();
+  std::exit(0);
+}
+
+void OptionParser::complete_choices(vector<string>& words, const Option* o,
+    const string& prefix, const string& val) const {
+  if (not o or o->nargs() == 0)
+    return;
+  for (list<string>::const_iterator it = o->choices().begin(); it != o->choices().end(); ++it) {
+    if (str_startswith(*it, val))
+      words.push_back(prefix + *it);
+  }
+}
+
+vector<string> OptionParser::complete(const int argc, char const* const* const argv, const int index) const {
+  vector<string> words;
+  string err;
+  const string word = (index < argc) ? argv[index] : "";
+  string prev = (index > 1 and index <= argc) ? argv[index-1] : "";
+
+  for (int i = 1; i < index and i < argc; ++i) {
+    if (string(argv[i]) == "--")
+      return words;
+  }
+
+  // shells splitting "--opt=val" into "--opt", "=", "val" replace only the
+  // text after the "="
+  if (word == "=" and str_startswith(prev, "--")) {
+    complete_choices(words, lookup_long_opt(prev.substr(2), err), "", "");
+    return words;
+  }
+  if (prev == "=" and index > 2)
+    prev = argv[index-2];
+
+  // value of the previous option
+  if (str_startswith(prev, "--") and prev.find('=') == string::npos) {
+    const Option* o = lookup_long_opt(prev.substr(2), err);
+    if (o and o->nargs() != 0) {
+      complete_choices(words, o, "", word);
+      return words;
+    }
+  } else if (prev.length() > 1 and prev[0] == '-' and prev[1] != '-') {
+    for (size_t i = 1; i < prev.length(); ++i) {
+      const Option* o = lookup_short_opt(prev.substr(i, 1), err);
+      if (not o or o->nargs() != 0) {
+        if (o and i == prev.length() - 1) {
+          complete_choices(words, o, "", word);
+          return words;
+        }
+        break;
+      }
+    }
+  }
+
+  if (str_startswith(word, "--")) {
+    size_t delim = word.find('=');
+    if (delim != string::npos) {
+      complete_choices(words, lookup_long_opt(word.substr(2, delim-2), err), word.substr(0, delim+1),
+          word.substr(delim+1));
+      return words;
+    }
+    // all names with this prefix are one contiguous range of the map
+    const string name = word.substr(2);
+    for (optMap::const_iterator it = _schema->_optmap_l.lower_bound(name);
+         it != _schema->_optmap_l.end() and str_startswith(it->first, name); ++it) {
+      if (it->second->help() != SUPPRESS_HELP)
+        words.push_back("--" + it->first);
+    }
+  } else if (word == "-") {
+    for (optMap::const_iterator it = _schema->_optmap_s.begin(); it != _schema->_optmap_s.end(); ++it) {
+      if (it->second->help() != SUPPRESS_HELP)
+        words.push_back("-" + it->first);
+    }
+    for (optMap::const_iterator it = _schema->_optmap_l.begin(); it != _schema->_optmap_l.end(); ++it) {
+      if (it->second->help() != SUPPRESS_HELP)
+        words.push_back("--" + it->first);
+    }
+  } else if (word.length() == 2 and word[0] == '-') {
+    if (_schema->_optmap_s.count(word.substr(1)))
+      words.push_back(word);
+  }
+  return words;
+}
+
+string OptionParser::completion_script(const string& shell) const {
+  string func = "_" + prog() + "_complete";
+  for (size_t i = 1; i < func.length(); ++i) {
+    if (not isalnum((unsigned char) func[i]))
+      func[i] = '_';
+  }
+
+  stringstream ss;
+  if (shell == "bash") {
+    ss << func << "() {" << endl
+       << "  local IFS=$'\\n'" << endl
+       << "  COMPREPLY=( $(OPTPARSE_COMPLETE=$COMP_CWORD \"${COMP_WORDS[@]}\" 2>/dev/null) )" << endl
+       << "}" << endl
+       << "complete -o default -F " << func << " " << prog() << endl;
+  } else if (shell == "zsh") {
+    ss << "#compdef " << prog() << endl
+       << func << "() {" << endl
+       << "  local -a reply" << endl
+       << "  reply=( ${(f)\"$(OPTPARSE_COMPLETE=$((CURRENT-1)) \"${(@)words}\" 2>/dev/null)\"} )" << endl
+       << "  if (( ${#reply} )); then compadd -Q -a reply; else _files; fi" << endl
+       << "}" << endl
+       << "compdef " << func << " " << prog() << endl;
+  } else if (shell == "fish") {
+    ss << "complete -c " << prog() << " -a '(env OPTPARSE_COMPLETE=(count (commandline -opc))"
+       << " (commandline -opc) (commandline -ct) 2>/dev/null)'" << endl;
+  }
+  return ss.str();
+}
+
+string OptionParser::shortest_opt(const Option& o) const {
+  if (not o._short_opts.empty())
+    return "-" + *o._short_opts.begin();
+
+  // abbreviations are not considered, they break as soon as options are
+  // added; a full name is ambiguous if another long option extends it
+  string best;
+  bool best_unique = false;
+  for (set<string>::const_iterator it = o._long_opts.begin(); it != o._long_opts.end(); ++it) {
+    optMap::const_iterator next = _schema->_optmap_l.upper_bound(*it);
+    bool unique = (next == _schema->_optmap_l.end() or not str_startswith(next->first, *it));
+    if (best == "" or (unique and not best_unique) or
+        (unique == best_unique and it->length() < best.length())) {
+      best = *it;
+      best_unique = unique;
+    }
+  }
+  return "--" + best;
+}
+
+void OptionParser::dest_to_argv(ArgvBuffer& out, const Values& values, const string& dest,
+    const list<Option const*>& opts) const {
+  if (not values.is_set(dest))
+    return;
+
+  list<Option const*>::const_iterator it;
+  const Option* append = 0;
+  for (it = opts.begin(); it != opts.end(); ++it) {
+    ActionInfo::Code c = (*it)->action_info().code;
+    if (c == ActionInfo::APPEND or c == ActionInfo::APPEND_CONST)
+      append = *it;
+  }
+  for (it = opts.begin(); it != opts.end(); ++it) {
+    if ((*it)->action_info().code != ActionInfo::MAP)
+      continue;
+    // NAME=VALUE arguments as given, duplicates resolve the same way again
+    const vector<const char*>& v = values.argv(dest);
+    for (size_t i = 0; i < v.size(); ++i) {
+      out.push_back(shortest_opt(**it));
+      out.push_back(v[i]);
+    }
+    return;
+  }
+  if (append and append->nargs() > 1) {
+    // fixed counts are split up again, variable ones were merged anyway
+    const vector<const char*>& v = values.argv(dest);
+    bool variable = (append->nargs() == ZERO_OR_MORE or append->nargs() == ONE_OR_MORE);
+    size_t n = variable ? v.size() : append->nargs();
+    for (size_t i = 0; i < v.size(); ++i) {
+      if (i % n == 0)
+        out.push_back(shortest_opt(*append));
+      out.push_back(v[i]);
+    }
+    return;
+  }
+  if (append) {
+    const list<string>& l = values.all(dest);
+    for (list<string>::const_iterator lit = l.begin(); lit != l.end(); ++lit) {
+      const Option* o = 0;
+      for (it = opts.begin(); it != opts.end() and not o; ++it) {
+        if ((*it)->action_info().code == ActionInfo::APPEND_CONST and (*it)->get_const() == *lit)
+          o = *it;
+      }
+      for (it = opts.begin(); it != opts.end() and not o; ++it) {
+        if ((*it)->action_info().code == ActionInfo::APPEND)
+          o = *it;
+      }
+      if (not o)
+        continue;
+      out.push_back(shortest_opt(*o));
+      if (o->action_info().code == ActionInfo::APPEND)
+        out.push_back(*lit);
+    }
+    return;
+  }
+
+  const string& v = values[dest];
+  if (not values.is_set_by_user(dest)) {
+    strMap::const_iterator dit = _schema->_defaults.find(dest);
+    string def = (dit != _schema->_defaults.end()) ? dit->second : "";
+    const Option* def_opt = 0;
+    for (it = opts.begin(); it != opts.end() and dit == _schema->_defaults.end() and def == ""; ++it) {
+      def = (*it)->get_default();
+      def_opt = *it;
+    }
+    // option defaults are stored converted, see set_default_values()
+    const TypeInfo* t = (def_opt and not def_opt->factory()) ? &def_opt->type_info() : 0;
+    shared_ptr<void> obj;
+    if (t and t->format and def != "" and def_opt->check_type("", def.c_str(), &obj) == "" and obj)
+      def = t->format(obj.get());
+    if (v == def)
+      return;
+  }
+
+  // options sharing a dest are tried in turn until one reproduces the value
+  for (it = opts.begin(); it != opts.end(); ++it) {
+    const Option& o = **it;
+    ActionInfo::Code c = o.action_info().code;
+    if (c == ActionInfo::STORE and o.nargs() > 1) {
+      const vector<const char*>& args = values.argv(dest);
+      out.push_back(shortest_opt(o));
+      for (size_t i = 0; i < args.size(); ++i)
+        out.push_back(args[i]);
+    } else if (c == ActionInfo::STORE) {
+      out.push_back(shortest_opt(o));
+      out.push_back(v);
+    } else if (c == ActionInfo::COUNT) {
+      long n = Value(v);
+      for (long i = 0; i < n; ++i)
+        out.push_back(shortest_opt(o));
+    } else if ((c == ActionInfo::STORE_TRUE and v == "1") or (c == ActionInfo::STORE_FALSE and v == "0") or
+               (c == ActionInfo::STORE_CONST and v == o.get_const())) {
+      out.push_back(shortest_opt(o));
+    } else {
+      continue;
+    }
+    break;
+  }
+}
+
+void OptionParser::opts_to_argv(ArgvBuffer& out, const Values& values, const list<Option const*>& opts) const {
+  list<string> dests;
+  map<string, list<Option const*> > by_dest;
+  for (list<Option const*>::const_iterator it = opts.begin(); it != opts.end(); ++it) {
+    // what a custom action stores cannot be mapped back to arguments
+    ActionInfo::Code c = (*it)->action_info().code;
+    if (c == ActionInfo::HELP or c == ActionInfo::VERSION or c == ActionInfo::CALLBACK or
+        c == ActionInfo::CUSTOM)
+      continue;
+    list<Option const*>& l = by_dest[(*it)->dest()];
+    if (l.empty())
+      dests.push_back((*it)->dest());
+    l.push_back(*it);
+  }
+  for (list<string>::const_iterator it = dests.begin(); it != dests.end(); ++it)
+    dest_to_argv(out, values, *it, by_dest[*it]);
+}
+
+void OptionParser::to_argv(ArgvBuffer& out, const Values& values) const {
+  list<Option const*> opts;
+  for (list<Option>::const_iterator it = _schema->_opts.begin(); it != _schema->_opts.end(); ++it)
+    opts.push_back(&*it);
+  for (list<OptionGroup const*>::const_iterator git = _schema->_groups.begin(); git != _schema->_groups.end(); ++git) {
+    for (list<Option>::const_iterator it = (*git)->_schema->_opts.begin(); it != (*git)->_schema->_opts.end(); ++it)
+      opts.push_back(&*it);
+  }
+  opts_to_argv(out, values, opts);
+}
+void OptionParser::to_argv(ArgvBuffer& out, const Values& values, const OptionGroup& group) const {
+  list<Option const*> opts;
+  for (list<Option>::const_iterator it = group._schema->_opts.begin(); it != group._schema->_opts.end(); ++it)
+    opts.push_back(&*it);
+  opts_to_argv(out, values, opts);
+}
+
 string OptionParser::format_option_help(unsigned int indent /* = 2 */) const {
   stringstream ss;
 
-  if (_opts.empty())
+  if (_schema->_opts.empty())
     return ss.str();
 
-  for (list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it) {
+  for (list<Option>::const_iterator it = _schema->_opts.begin(); it != _schema->_opts.end(); ++it) {
     if (it->help() != SUPPRESS_HELP)
       ss << it->format_help(indent);
   }
@@ -384,7 +1806,7 @@ string OptionParser::format_help() const {
   ss << _("Options") << ":" << endl;
   ss << format_option_help();
 
-  for (list<OptionGroup const*>::const_iterator it = _groups.begin(); it != _groups.end(); ++it) {
+  for (list<OptionGroup const*>::const_iterator it = _schema->_groups.begin(); it != _schema->_groups.end(); ++it) {
     const OptionGroup& group = **it;
     ss << endl << "  " << group.title() << ":" << endl;
     if (group.group_description() != "")
@@ -441,70 +1863,418 @@ void OptionParser::print_version() const {
 void OptionParser::exit() const {
   std::exit(2);
 }
+// serializes error() from deferred callbacks running at the same time
+static mutex deferred_errors;
+
 void OptionParser::error(const string& msg) const {
+  if (_deferring) {
+    lock_guard<mutex> lock(deferred_errors);
+    _errors.push_back(msg);
+    return;
+  }
+  if (not allow_exit()) {
+    _errors.push_back(msg);
+    return;
+  }
   print_usage(cerr);
   cerr << prog() << ": " << _("error") << ": " << msg << endl;
   exit();
 }
 ////////// } class OptionParser //////////
 
+////////// class Bitset { //////////
+const size_t Bitset::bits;
+const size_t Bitset::npos;
+
+Bitset& Bitset::set(size_t i) {
+  if (i / bits >= _words.size())
+    _words.resize(i / bits + 1);
+  _words[i / bits] |= word(1) << (i % bits);
+  return *this;
+}
+Bitset& Bitset::set(size_t first, size_t last) {
+  if (last / bits >= _words.size())
+    _words.resize(last / bits + 1);
+  for (size_t k = first / bits; k <= last / bits; ++k) {
+    word w = ~word(0);
+    if (k == first / bits)
+      w &= ~word(0) << (first % bits);
+    if (k == last / bits and last % bits != bits - 1)
+      w &= (word(1) << (last % bits + 1)) - 1;
+    _words[k] |= w;
+  }
+  return *this;
+}
+Bitset& Bitset::reset(size_t i) {
+  if (i / bits < _words.size())
+    _words[i / bits] &= ~(word(1) << (i % bits));
+  return *this;
+}
+Bitset& Bitset::operator|= (const Bitset& other) {
+  if (other._words.size() > _words.size())
+    _words.resize(other._words.size());
+  for (size_t k = 0; k < other._words.size(); ++k)
+    _words[k] |= other._words[k];
+  return *this;
+}
+bool Bitset::any() const {
+  for (size_t k = 0; k < _words.size(); ++k) {
+    if (_words[k])
+      return true;
+  }
+  return false;
+}
+size_t Bitset::count() const {
+  size_t n = 0;
+  for (size_t k = 0; k < _words.size(); ++k) {
+    for (word w = _words[k]; w; w &= w - 1)
+      n++;
+  }
+  return n;
+}
+bool Bitset::intersects(const Bitset& other) const {
+  size_t n = min(_words.size(), other._words.size());
+  for (size_t k = 0; k < n; ++k) {
+    if (_words[k] & other._words[k])
+      return true;
+  }
+  return false;
+}
+bool Bitset::contains(const Bitset& other) const {
+  for (size_t k = 0; k < other._words.size(); ++k) {
+    word w = (k < _words.size()) ? _words[k] : 0;
+    if (other._words[k] & ~w)
+      return false;
+  }
+  return true;
+}
+size_t Bitset::find_next(size_t i /* = npos */) const {
+  // npos + 1 wraps around to 0
+  size_t start = i + 1;
+  for (size_t k = start / bits; k < _words.size(); ++k) {
+    word w = _words[k];
+    if (k == start / bits)
+      w &= ~word(0) << (start % bits);
+    if (w == 0)
+      continue;
+    size_t b = 0;
+    while (not ((w >> b) & 1))
+      b++;
+    return k * bits + b;
+  }
+  return npos;
+}
+////////// } class Bitset //////////
+
+////////// class ParseStream { //////////
+ParseStream::ParseStream(OptionParser& parser, char const* const* begin, char const* const* end) :
+  _parser(parser), _cur(begin), _end(end), _buf(0), _buf_end(0),
+  _arg(0), _cluster(0), _options_done(false), _allow_abbrev(true), _check_paths(true),
+  _suggest(true) {
+  parser.add_default_options();
+}
+ParseStream::ParseStream(OptionParser& parser, const char* buf, size_t len) :
+  _parser(parser), _cur(0), _end(0), _buf(buf), _buf_end(buf + len),
+  _arg(0), _cluster(0), _options_done(false), _allow_abbrev(true), _check_paths(true),
+  _suggest(true) {
+  parser.add_default_options();
+}
+
+const char* ParseStream::take() {
+  if (not _buf)
+    return *_cur++;
+  const char* arg = _buf;
+  const void* nul = memchr(_buf, '\0', _buf_end - _buf);
+  _buf = nul ? static_cast<const char*>(nul) + 1 : _buf_end;
+  return arg;
+}
+
+bool ParseStream::next(ParseEvent& ev) {
+  ev.option = 0;
+  ev.value = "";
+  ev.values = 0;
+  ev.nvalues = 0;
+  ev.object.reset();
+
+  if (_cluster)
+    return next_short(ev);
+
+  if (at_end())
+    return false;
+  const char* arg = take();
+
+  if (not _options_done and arg[0] == '-') {
+    if (arg[1] == '-' and arg[2] == '\0') {
+      _options_done = true;
+      return next(ev);
+    }
+    if (arg[1] == '-')
+      return next_long(ev, arg + 2);
+    if (arg[1] != '\0') {
+      _arg = arg;
+      _cluster = arg + 1;
+      return next_short(ev);
+    }
+  }
+
+  if (not _parser.interspersed_args())
+    _options_done = true;
+  ev.kind = ParseEvent::POSITIONAL;
+  ev.opt.clear();
+  ev.value = arg;
+  return true;
+}
+
+bool ParseStream::next_short(ParseEvent& ev) {
+  const char* rest = _cluster + 1;
+  ev.opt.assign(1, '-');
+  ev.opt += *_cluster;
+
+  ev.option = _parser.lookup_short_opt(ev.opt.substr(1), ev.error);
+  if (not ev.option) {
+    ev.kind = ParseEvent::UNKNOWN;
+    ev.value = (_cluster == _arg + 1) ? _arg : _cluster;
+    // most likely a long option given with a single dash
+    if (_suggest and _arg[2] != '\0')
+      ev.error += _parser.suggest_long_opt(_arg + 1);
+    _cluster = 0;
+    return true;
+  }
+  _cluster = 0;
+
+  if (ev.option->nargs() == 1) {
+    if (*rest != '\0')
+      ev.value = rest;
+    else if (not at_end())
+      ev.value = take();
+    else
+      return invalid(ev, ev.opt + " " + _("option requires an argument"));
+  } else if (ev.option->nargs() > 1) {
+    return take_values(ev, (*rest != '\0') ? rest : 0);
+  } else if (*rest != '\0') {
+    _cluster = rest;
+  }
+  return check(ev);
+}
+
+bool ParseStream::next_long(ParseEvent& ev, const char* optstr) {
+  const char* delim = strchr(optstr, '=');
+  _name.assign(optstr, delim ? delim - optstr : strlen(optstr));
+  ev.opt.assign("--");
+  ev.opt += _name;
+
+  bool unknown = false;
+  ev.option = _parser.lookup_long_opt(_name, ev.error, _allow_abbrev, &unknown, _suggest);
+  if (not ev.option) {
+    ev.kind = unknown ? ParseEvent::UNKNOWN : ParseEvent::INVALID;
+    ev.value = optstr - 2;
+    return true;
+  }
+
+  if (ev.option->nargs() > 1)
+    return take_values(ev, delim ? delim + 1 : 0);
+  if (delim)
+    ev.value = delim + 1;
+  else if (ev.option->nargs() == 1 and not at_end())
+    ev.value = take();
+
+  if (ev.option->nargs() == 1 and *ev.value == '\0')
+    return invalid(ev, ev.opt + " " + _("option requires an argument"));
+  return check(ev);
+}
+
+bool ParseStream::take_values(ParseEvent& ev, const char* first) {
+  const size_t n = ev.option->nargs();
+  const bool variable = (n == ZERO_OR_MORE or n == ONE_OR_MORE);
+  char const* const* start = _cur;
+
+  _values.clear();
+  if (first)
+    _values.push_back(first);
+  if (variable) {
+    while (const char* v = take_value())
+      _values.push_back(v);
+  } else {
+    while (_values.size() < n and not at_end())
+      _values.push_back(take());
+  }
+
+  if (n == ONE_OR_MORE and _values.empty())
+    return invalid(ev, ev.opt + " " + _("option requires at least one argument"));
+  if (not variable and _values.size() < n) {
+    stringstream ss;
+    ss << ev.opt << " " << _("option requires") << " " << n << " " << _("arguments");
+    return invalid(ev, ss.str());
+  }
+
+  // whole arguments taken one after the other are viewed in place
+  ev.nvalues = _values.size();
+  ev.values = (not _buf and not first) ? start : _values.data();
+  ev.value = ev.nvalues ? ev.values[0] : "";
+  return check(ev);
+}
+
+const char* ParseStream::take_value() {
+  if (_cluster or _options_done or at_end())
+    return 0;
+  const char* arg = _buf ? _buf : *_cur;
+  if (arg[0] == '-' and arg[1] != '\0')
+    return 0;
+  return take();
+}
+
+bool ParseStream::check(ParseEvent& ev) const {
+  ev.kind = ParseEvent::OPTION;
+  if (ev.option->nargs() == 1) {
+    ev.values = &ev.value;
+    ev.nvalues = 1;
+  }
+  if (ev.option->action_info().typed and (_check_paths or not ev.option->type_info().path)) {
+    ev.error.clear();
+    for (size_t i = 0; i < ev.nvalues and ev.error == ""; ++i)
+      ev.error = ev.option->check_type(ev.opt, ev.values[i], (ev.nvalues == 1) ? &ev.object : 0);
+    if (ev.error != "")
+      ev.kind = ParseEvent::INVALID;
+  }
+  return true;
+}
+
+bool ParseStream::invalid(ParseEvent& ev, const string& msg) const {
+  ev.kind = ParseEvent::INVALID;
+  ev.error = msg;
+  return true;
+}
+////////// } class ParseStream //////////
+
 ////////// class Values { //////////
 const string& Values::operator[] (const string& d) const {
   strMap::const_iterator it = _map.find(d);
   static const string empty = "";
   return (it != _map.end()) ? it->second : empty;
 }
+const list<string>& Values::all(const string& d) const {
+  lstMap::const_iterator it = _appendMap.find(d);
+  static const list<string> empty;
+  return (it != _appendMap.end()) ? it->second : empty;
+}
+size_t StrRefHash::operator() (const StrRef& s) const {
+  // FNV-1a
+  size_t h = 2166136261u;
+  for (size_t i = 0; i < s.size; ++i)
+    h = (h ^ (unsigned char) s.data[i]) * 16777619u;
+  return h;
+}
+size_t OptionParser::CStrHash::operator() (const char* s) const {
+  // FNV-1a
+  size_t h = 2166136261u;
+  for (; *s; ++s)
+    h = (h ^ (unsigned char) *s) * 16777619u;
+  return h;
+}
+bool OptionParser::CStrEqual::operator() (const char* a, const char* b) const {
+  return strcmp(a, b) == 0;
+}
+
+const vector<const char*>& Values::argv(const string& d) const {
+  map<string, vector<const char*> >::const_iterator it = _argvMap.find(d);
+  static const vector<const char*> empty;
+  return (it != _argvMap.end()) ? it->second : empty;
+}
 void Values::is_set_by_user(const string& d, bool yes) {
   if (yes)
     _userSet.insert(d);
   else
     _userSet.erase(d);
 }
-////////// } class Values //////////
-
-////////// class Option { //////////
-string Option::check_type(const string& opt, const string& val) const {
-  istringstream ss(val);
-  stringstream err;
+// FNV-1a over the string including a terminating NUL, so that the
+// fields ("ab", "c") and ("a", "bc") hash differently
+static uint64_t hash_field(uint64_t h, const string& s) {
+  const uint64_t prime = 0x100000001b3ULL;
+  for (size_t i = 0; i < s.length(); ++i)
+    h = (h ^ (unsigned char) s[i]) * prime;
+  return h * prime;
+}
+// splitmix64 finalizer, spreads each entry hash before they are summed
+static uint64_t hash_mix(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+uint64_t Values::fingerprint(bool user_set_only /* = false */) const {
+  const uint64_t basis = 0xcbf29ce484222325ULL;
+  uint64_t sum = 0, n = 0;
 
-  if (type() == "int" || type() == "long") {
-    long t;
-    if (not (ss >> t))
-      err << _("option") << " " << opt << ": " << _("invalid integer value") << ": '" << val << "'";
+  // entries are combined by addition, so the result does not depend on
+  // the order in which they are visited
+  for (strMap::const_iterator it = _map.begin(); it != _map.end(); ++it) {
+    if (user_set_only and not is_set_by_user(it->first))
+      continue;
+    sum += hash_mix(hash_field(hash_field(basis, it->first), it->second));
+    n++;
   }
-  else if (type() == "float" || type() == "double") {
-    double t;
-    if (not (ss >> t))
-      err << _("option") << " " << opt << ": " << _("invalid floating-point value") << ": '" << val << "'";
+  for (lstMap::const_iterator it = _appendMap.begin(); it != _appendMap.end(); ++it) {
+    if (it->second.empty() or (user_set_only and not is_set_by_user(it->first)))
+      continue;
+    uint64_t h = hash_field(~basis, it->first);
+    for (list<string>::const_iterator lit = it->second.begin(); lit != it->second.end(); ++lit)
+      h = hash_field(h, *lit);
+    sum += hash_mix(h);
+    n++;
   }
-  else if (type() == "choice") {
-    if (find(choices().begin(), choices().end(), val) == choices().end()) {
-      list<string> tmp = choices();
-      transform(tmp.begin(), tmp.end(), tmp.begin(), str_wrap("'"));
-      err << _("option") << " " << opt << ": " << _("invalid choice") << ": '" << val << "'"
-        << " (" << _("choose from") << " " << str_join(", ", tmp.begin(), tmp.end()) << ")";
-    }
+  for (map<string, vector<const char*> >::const_iterator it = _argvMap.begin(); it != _argvMap.end(); ++it) {
+    if (it->second.empty() or (user_set_only and not is_set_by_user(it->first)))
+      continue;
+    uint64_t h = hash_field(basis ^ 1, it->first);
+    for (size_t i = 0; i < it->second.size(); ++i)
+      h = hash_field(h, it->second[i]);
+    sum += hash_mix(h);
+    n++;
   }
-  else if (type() == "complex") {
-    complex<double> t;
-    if (not (ss >> t))
-      err << _("option") << " " << opt << ": " << _("invalid complex value") << ": '" << val << "'";
+  return hash_mix(sum ^ hash_mix(n));
+}
+////////// } class Values //////////
+
+////////// class Option { //////////
+string Option::check_type(const string& opt, const char* val, shared_ptr<void>* obj /* = 0 */) const {
+  if (_factory) {
+    shared_ptr<void> t;
+    string reason = _("invalid value");
+    try {
+      t = _factory(val);
+    } catch (const exception& e) {
+      reason = e.what();
+    }
+    if (not t)
+      return type_error(opt, reason, val);
+    if (obj)
+      *obj = t;
+    return "";
   }
 
-  return err.str();
+  const typeChecker& check = type_info().check;
+  return check ? check(*this, opt, val, obj) : "";
 }
 
 string Option::format_option_help(unsigned int indent /* = 2 */) const {
 
   string mvar_short, mvar_long;
-  if (nargs() == 1) {
+  if (nargs() != 0) {
     string mvar = metavar();
     if (mvar == "") {
       mvar = type();
       transform(mvar.begin(), mvar.end(), mvar.begin(), ::toupper);
      }
-    mvar_short = " " + mvar;
-    mvar_long = "=" + mvar;
+    if (nargs() == ZERO_OR_MORE) {
+      mvar_short = mvar_long = " [" + mvar + " ...]";
+    } else {
+      string more;
+      if (nargs() == ONE_OR_MORE)
+        more = " [" + mvar + " ...]";
+      for (size_t i = 1; i < nargs() and nargs() != ONE_OR_MORE; ++i)
+        more += " " + mvar;
+      mvar_short = " " + mvar + more;
+      mvar_long = "=" + mvar + more;
+    }
   }
 
   stringstream ss;
@@ -544,13 +2314,28 @@ string Option::format_help(unsigned int indent /* = 2 */) const {
   return ss.str();
 }
 
+Option& Option::type(const string& t) {
+  _type = t;
+  _type_id = type_id(t);
+  return *this;
+}
+const TypeInfo& Option::type_info() const {
+  return type_table()[_type_id];
+}
+Option::ValueKind Option::value_kind() const {
+  return _factory ? STRING_VALUE : type_info().value;
+}
+
 Option& Option::action(const string& a) {
   _action = a;
-  if (a == "store_const" || a == "store_true" || a == "store_false" ||
-      a == "append_const" || a == "count" || a == "help" || a == "version")
-    nargs(0);
+  _action_id = action_id(a);
+  if (action_info().nargs != 1)
+    nargs(action_info().nargs);
   return *this;
 }
+const ActionInfo& Option::action_info() const {
+  return action_table()[_action_id];
+}
 ////////// } class Option //////////
 
 }
@@ -29,12 +29,10 @@
  * - similarity to Python desired for faster learning curve
  *
  * Future work:
- * - nargs > 1?
  * - comments?
  *
  * Python only features:
  * - conflict handlers
- * - adding new actions
  *
  *
  * Example:
@@ -65,8 +63,16 @@
 #include <list>
 #include <map>
 #include <set>
+#include <unordered_set>
+#include <unordered_map>
 #include <iostream>
 #include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <functional>
+#include <climits>
+#include <stdint.h>
 
 namespace optparse {
 
@@ -76,13 +82,61 @@ class Option;
 class Values;
 class Value;
 class Callback;
+class ParseStream;
+class ParseEvent;
+class TypeInfo;
+class ActionInfo;
 
 typedef std::map<std::string,std::string> strMap;
 typedef std::map<std::string,std::list<std::string> > lstMap;
 typedef std::map<std::string,Option const*> optMap;
+//! Invocable callback: the option, the option as given (e.g. "-f") and its
+//! type checked argument ("" if none), pointing into the parsed arguments;
+//! options taking more than one argument call back once per argument
+typedef std::function<void (const Option&, const std::string&, const char*, OptionParser&)> callbackFn;
+//! Builds the object of a user type from an argument, see Option::factory();
+//! returns 0 or throws a std::exception if the argument is invalid
+typedef std::function<std::shared_ptr<void> (const char*)> factoryFn;
+//! Checker of an option type: the error message for the argument of the
+//! option as given (e.g. "--addr"), "" if it is valid; stores the parsed
+//! object in the last argument if that is not 0 (see Values::as())
+typedef std::function<std::string (const Option&, const std::string&, const char*,
+    std::shared_ptr<void>*)> typeChecker;
+//! Handler of an action: carries out the option of the event (see
+//! ParseEvent) on the values being parsed; problems go to
+//! OptionParser::error()
+typedef std::function<void (const ParseEvent&, Values&, OptionParser&)> actionFn;
+
+//! Characters [data, data + size) of a string stored elsewhere
+class StrRef {
+  public:
+    StrRef() : data(""), size(0) {}
+    StrRef(const char* s) : data(s), size(std::strlen(s)) {}
+    StrRef(const char* s, size_t n) : data(s), size(n) {}
+    StrRef(const std::string& s) : data(s.data()), size(s.size()) {}
+    std::string str() const { return std::string(data, size); }
+    bool operator== (const StrRef& other) const {
+      return size == other.size and std::memcmp(data, other.data, size) == 0;
+    }
+
+    const char* data;
+    size_t size;
+};
+class StrRefHash {
+  public:
+    size_t operator() (const StrRef& s) const;
+};
+//! Entries of a "map" option: NAME -> VALUE, both pointing into the parsed
+//! arguments, or the Values' copy of them ("" for a NAME given without "=");
+//! they last until the next parse
+typedef std::unordered_map<StrRef,const char*,StrRefHash> refMap;
 
 const char* const SUPPRESS_HELP = "SUPPRESS" "HELP";
 const char* const SUPPRESS_USAGE = "SUPPRESS" "USAGE";
+//! Option::nargs() for a variable number of arguments: all following
+//! arguments up to the next option
+const size_t ZERO_OR_MORE = static_cast<size_t>(-1);
+const size_t ONE_OR_MORE = static_cast<size_t>(-2);
 
 //! Class for automatic conversion from string -> anytype
 class Value {
@@ -105,6 +159,8 @@ class Value {
     bool valid;
 };
 
+//! Copies are deep (except for the parsed objects of as(), which are
+//! immutable and shared), moves are O(1)
 class Values {
   public:
     Values() : _map() {}
@@ -117,20 +173,128 @@ class Values {
 
     typedef std::list<std::string>::iterator iterator;
     typedef std::list<std::string>::const_iterator const_iterator;
+    //! Appended values, copied from argv() at the end of each parse so that
+    //! the const members only read
     std::list<std::string>& all(const std::string& d) { return _appendMap[d]; }
-    const std::list<std::string>& all(const std::string& d) const { return _appendMap.find(d)->second; }
+    const std::list<std::string>& all(const std::string& d) const;
+
+    //! Arguments of append and map options, and of options taking more
+    //! than one (nargs > 1), one after the other. They point into the parsed
+    //! arguments (or the parser's options for append_const), which must
+    //! outlive them. all() holds copies of the appended values, for map
+    //! options operator[] gives the number of entries, for options taking
+    //! more than one the number of arguments.
+    std::vector<const char*>& argv(const std::string& d) { return _argvMap[d]; }
+    const std::vector<const char*>& argv(const std::string& d) const;
+
+    //! Value parsed by the option type, e.g. std::vector<int64_t> for
+    //! "int_list", std::vector<double> for "float_list", Bitset for
+    //! "range_set", uint64_t for "size" (bytes, e.g. "64K", "1.5GiB",
+    //! "512MB": K, Ki, KiB, ... are powers of 1024, KB, ... of 1000) and
+    //! "duration" (nanoseconds, e.g. "250ms", "2h30m": units ns, us, ms,
+    //! s, m, h, d), refMap for action "map", and the object built by
+    //! Option::factory(); 0 if there is none. T must be the type the
+    //! option stores. operator[] gives sizes as bytes ("65536") and
+    //! durations as nanoseconds ("250000000ns").
+    template<typename T>
+    const T* as(const std::string& d) const {
+      std::map<std::string,std::shared_ptr<void> >::const_iterator it = _objMap.find(d);
+      return (it != _objMap.end()) ? static_cast<const T*>(it->second.get()) : 0;
+    }
+    std::shared_ptr<void>& object(const std::string& d) { return _objMap[d]; }
+
+    //! Stable 64-bit hash of all values and append lists, independent of
+    //! iteration order; optionally restricted to values set by the user.
+    uint64_t fingerprint(bool user_set_only = false) const;
 
   private:
     strMap _map;
     lstMap _appendMap;
+    std::map<std::string,std::vector<const char*> > _argvMap;
+    std::map<std::string,std::shared_ptr<void> > _objMap;
     std::set<std::string> _userSet;
+    //! copy of arguments given as strings, argv() and as() point into it
+    std::shared_ptr<const std::string> _args;
+
+    friend class OptionParser;
+};
+
+//! Arguments stored NUL-separated in one buffer, as execve() expects them
+class ArgvBuffer {
+  public:
+    ArgvBuffer() : _buf(), _offsets() {}
+    void push_back(const std::string& arg);
+    void clear() { _buf.clear(); _offsets.clear(); }
+    size_t size() const { return _offsets.size(); }
+    const char* operator[] (size_t i) const { return &_buf[_offsets[i]]; }
+    const std::vector<char>& buffer() const { return _buf; }
+    //! NULL-terminated pointer array, valid until the buffer is modified
+    char* const* argv() const;
+
+  private:
+    std::vector<char> _buf;
+    std::vector<size_t> _offsets;
+    mutable std::vector<char*> _argv;
+};
+
+//! Set of small non-negative integers, one bit each in machine words.
+//! words() has the layout of a glibc cpu_set_t, so a CPU list can be
+//! copied into one with CPU_ALLOC()/memcpy() (zero-filling the rest).
+class Bitset {
+  public:
+    typedef unsigned long word;
+    static const size_t bits = sizeof(word) * CHAR_BIT;
+    static const size_t npos = static_cast<size_t>(-1);
+
+    Bitset() : _words() {}
+    //! Room for 0 .. n-1 without reallocating; set() grows as needed
+    explicit Bitset(size_t n) : _words((n + bits - 1) / bits) {}
+
+    Bitset& set(size_t i);
+    //! Add first .. last (inclusive)
+    Bitset& set(size_t first, size_t last);
+    Bitset& reset(size_t i);
+    Bitset& operator|= (const Bitset& other);
+    bool test(size_t i) const {
+      return i / bits < _words.size() and (_words[i / bits] >> (i % bits)) & 1;
+    }
+    bool any() const;
+    size_t count() const;
+    //! Some element is in both sets
+    bool intersects(const Bitset& other) const;
+    //! All elements of other are in this set
+    bool contains(const Bitset& other) const;
+    //! Smallest element greater than i (or the smallest at all), npos if none
+    size_t find_next(size_t i = npos) const;
+
+    const std::vector<word>& words() const { return _words; }
+
+  private:
+    std::vector<word> _words;
 };
 
 class OptionParser {
   public:
     OptionParser();
+    //! Copies duplicate the options and rebuild the lookup tables to point
+    //! at the duplicates; added groups are shared, not copied
+    OptionParser(const OptionParser& other);
+    //! Moves are O(1): list nodes, and thus the lookup tables, are taken over;
+    //! the moved-from parser is left with an empty option table and can be
+    //! assigned to or given new options
+    OptionParser(OptionParser&& other);
     virtual ~OptionParser() {}
 
+    OptionParser& operator=(const OptionParser& other);
+    OptionParser& operator=(OptionParser&& other);
+
+    //! Lightweight parser sharing the option table (options, lookup tables,
+    //! defaults) of this one by reference count; only the settings and the
+    //! parse state are its own, the latter starting out empty. Instances see
+    //! the table as it was when they were created, so finish adding options
+    //! first.
+    OptionParser instance();
+
     OptionParser& usage(const std::string& u) { set_usage(u); return *this; }
     OptionParser& version(const std::string& v) { _version = v; return *this; }
     OptionParser& description(const std::string& d) { _description = d; return *this; }
@@ -138,13 +302,37 @@ class OptionParser {
     OptionParser& add_version_option(bool v) { _add_version_option = v; return *this; }
     OptionParser& prog(const std::string& p) { _prog = p; return *this; }
     OptionParser& epilog(const std::string& e) { _epilog = e; return *this; }
-    OptionParser& set_defaults(const std::string& dest, const std::string& val) {
-      _defaults[dest] = val; return *this;
-    }
+    OptionParser& set_defaults(const std::string& dest, const std::string& val);
     OptionParser& enable_interspersed_args() { _interspersed_args = true; return *this; }
     OptionParser& disable_interspersed_args() { _interspersed_args = false; return *this; }
+    //! If false, parsing never exits the program: errors are collected in
+    //! errors() and help/version options are ignored. Meant for parsing the
+    //! command lines of other programs.
+    OptionParser& allow_exit(bool e) { _allow_exit = e; return *this; }
+    //! Deferred callbacks (see Option::defer) run after parsing on up to n
+    //! threads, 0 meaning one per core (default: 1). Callbacks that may run
+    //! at the same time must not modify the parser, except through error():
+    //! the first error is reported once the callbacks are done. An exception
+    //! thrown by a callback is rethrown by parse_args() once the running
+    //! ones have returned.
+    OptionParser& callback_threads(unsigned int n) { _callback_threads = n; return *this; }
     OptionParser& add_option_group(const OptionGroup& group);
 
+    //! Constraints checked after parsing, on the options given by the user
+    //! (defaults do not count). Options are named as in add_option(), e.g.
+    //! "-f" or "--file", and must have been added already; a rule is
+    //! compiled into a bit mask over the options it mentions, so checking
+    //! does not look anything up by name.
+    OptionParser& required(const std::string& opt);
+    OptionParser& mutually_exclusive(const std::string& opt1, const std::string& opt2);
+    OptionParser& mutually_exclusive(const std::string& opt1, const std::string& opt2, const std::string& opt3);
+    OptionParser& mutually_exclusive(const std::vector<std::string>& opts);
+    OptionParser& at_least_one_of(const std::string& opt1, const std::string& opt2);
+    OptionParser& at_least_one_of(const std::string& opt1, const std::string& opt2, const std::string& opt3);
+    OptionParser& at_least_one_of(const std::vector<std::string>& opts);
+    //! If opt is given, other must be given as well
+    OptionParser& depends(const std::string& opt, const std::string& other);
+
     const std::string& usage() const { return _usage; }
     const std::string& version() const { return _version; }
     const std::string& description() const { return _description; }
@@ -153,6 +341,8 @@ class OptionParser {
     const std::string& prog() const { return _prog; }
     const std::string& epilog() const { return _epilog; }
     bool interspersed_args() const { return _interspersed_args; }
+    bool allow_exit() const { return _allow_exit; }
+    unsigned int callback_threads() const { return _callback_threads; }
 
     Option& add_option(const std::string& opt);
     Option& add_option(const std::string& opt1, const std::string& opt2);
@@ -160,17 +350,62 @@ class OptionParser {
     Option& add_option(const std::vector<std::string>& opt);
 
     Values& parse_args(int argc, char const* const* argv);
+    //! The arguments are copied, the Values keep the copy alive
     Values& parse_args(const std::vector<std::string>& args);
+    //! Arguments (starting with the program name) stored one after the
+    //! other, each followed by a NUL, like /proc/<pid>/cmdline
+    Values& parse_args(const char* buf, size_t len);
     template<typename InputIterator>
     Values& parse_args(InputIterator begin, InputIterator end) {
       return parse_args(std::vector<std::string>(begin, end));
     }
+    //! Hand the parse results directly to handler, which needs the members
+    //!   on_flag(const Option&)                 options without argument
+    //!   on_value(const Option&, T)             T is long for "int"/"long",
+    //!                                          double for "float"/"double",
+    //!                                          const char* otherwise; called
+    //!                                          once per argument
+    //!   on_positional(const char*)
+    //!   on_error(const std::string&)
+    //! Nothing is stored in Values or args(), and no action is carried out.
+    template<typename Handler>
+    void parse_args(Handler& handler, int argc, char const* const* argv);
+    //! Like parse_args(), but unknown options are collected in unknown_args()
+    //! instead of being an error
+    Values& parse_known_args(int argc, char const* const* argv);
+    Values& parse_known_args(const std::vector<std::string>& args);
+    Values& parse_known_args(const char* buf, size_t len);
+    //! Quick scan for a few options (e.g. --config) before the full parser
+    //! exists: long options must be given in full, unknown options, errors
+    //! and help/version/callback actions are ignored, and scanning stops at
+    //! the end of the options. Stores values and defaults, not args().
+    Values& prescan_args(int argc, char const* const* argv);
+
+    //! Unknown options seen by parse_known_args(), in order, each followed
+    //! by the next argument if it looks like the option's value. The
+    //! pointers refer to the parsed arguments, which must outlive them.
+    const std::vector<const char*>& unknown_args() const { return _unknown; }
 
     const std::list<std::string>& args() const { return _leftover; }
     std::vector<std::string> args() {
       return std::vector<std::string>(_leftover.begin(), _leftover.end());
     }
 
+    //! Append the arguments reproducing the user-set or non-default values,
+    //! one option spelling per option (the shortest one that is unambiguous);
+    //! options with actions added by register_action() are left out
+    void to_argv(ArgvBuffer& out, const Values& values) const;
+    //! Same, restricted to the options of one group
+    void to_argv(ArgvBuffer& out, const Values& values, const OptionGroup& group) const;
+
+    //! Completions for argv[index] (index == argc: a new, empty word): the
+    //! matching options, or the matching choices of an option's value.
+    //! parse_args(argc, argv) prints them and exits if the environment
+    //! variable OPTPARSE_COMPLETE is set to the index, before parsing.
+    std::vector<std::string> complete(int argc, char const* const* argv, int index) const;
+    //! Script hooking the above into "bash", "zsh" or "fish"
+    std::string completion_script(const std::string& shell) const;
+
     std::string format_help() const;
     std::string format_option_help(unsigned int indent = 2) const;
     void print_help() const;
@@ -186,17 +421,56 @@ class OptionParser {
 
     void error(const std::string& msg) const;
     void exit() const;
+    const std::list<std::string>& errors() const { return _errors; }
 
   private:
-    const Option& lookup_short_opt(const std::string& opt) const;
-    const Option& lookup_long_opt(const std::string& opt) const;
+    class Schema;
+    //! option, option as given, argument
+    struct OptArg {
+      const Option* option;
+      std::string opt;
+      const char* value;
+    };
+
+    OptionParser(const OptionParser& other, bool share);
+    Schema& detach();
+    void add_default_options();
+
+    const Option* lookup_short_opt(const std::string& opt, std::string& err) const;
+    std::string suggest_long_opt(const std::string& opt) const;
+    const Option* lookup_long_opt(const std::string& opt, std::string& err, bool abbrev = true,
+        bool* unknown = 0, bool suggest = true) const;
+
+    const Option* find_opt(const std::string& opt) const;
+    size_t constraint_id(const std::string& opt);
+    Bitset constraint_mask(const std::vector<std::string>& opts);
+    std::string constraint_names(const Bitset& mask) const;
+    void check_constraints() const;
+
+    std::shared_ptr<const std::string> copy_args(const std::vector<std::string>& args) const;
+    void start_parse(const std::shared_ptr<const std::string>& args);
+    Values& parse_tokens(ParseStream& stream, bool known,
+        const std::shared_ptr<const std::string>& args = std::shared_ptr<const std::string>());
+    void add_unknown(ParseStream& stream, const char* arg);
+    void store_appended();
+    Values& set_default_values();
+    void process_opt(const ParseEvent& ev);
+    void store_object(const Option& option, const std::shared_ptr<void>& obj);
+    void call_callback(const Option& option, const std::string& opt, const char* value);
+    size_t callback_level(const Option* option, std::map<Option const*, size_t>& levels) const;
+    void run_deferred();
+    void check_path_args(const std::vector<OptArg>& args);
 
-    void handle_short_opt(const std::string& opt, const std::string& arg);
-    void handle_long_opt(const std::string& optstr);
+    std::string format_usage(const std::string& u) const;
 
-    void process_opt(const Option& option, const std::string& opt, const std::string& value);
+    void handle_completion(int argc, char const* const* argv);
+    void complete_choices(std::vector<std::string>& words, const Option* option,
+        const std::string& prefix, const std::string& val) const;
 
-    std::string format_usage(const std::string& u) const;
+    std::string shortest_opt(const Option& option) const;
+    void dest_to_argv(ArgvBuffer& out, const Values& values, const std::string& dest,
+        const std::list<Option const*>& opts) const;
+    void opts_to_argv(ArgvBuffer& out, const Values& values, const std::list<Option const*>& opts) const;
 
     std::string _usage;
     std::string _version;
@@ -206,43 +480,74 @@ class OptionParser {
     std::string _prog;
     std::string _epilog;
     bool _interspersed_args;
+    bool _allow_exit;
+    unsigned int _callback_threads;
 
     Values _values;
 
-    std::list<Option> _opts;
-    optMap _optmap_s;
-    optMap _optmap_l;
-    strMap _defaults;
-    std::list<OptionGroup const*> _groups;
+    //! Copied on write by detach() when shared with instances
+    std::shared_ptr<Schema> _schema;
 
-    std::list<std::string> _remaining;
     std::list<std::string> _leftover;
+    //! constraint ids of the options given so far
+    Bitset _seen;
+
+    //! hash and compare the strings, not the pointers
+    struct CStrHash {
+      size_t operator() (const char* s) const;
+    };
+    struct CStrEqual {
+      bool operator() (const char* a, const char* b) const;
+    };
+    typedef std::map<std::string, std::unordered_set<const char*, CStrHash, CStrEqual> > appendedMap;
+    //! values appended so far to dests of deduplicating options
+    appendedMap _appended;
+    std::vector<const char*> _unknown;
+    //! unknown options split off a group of short options
+    std::list<std::string> _unknown_buf;
+    mutable std::list<std::string> _errors;
+
+    //! deferred callbacks
+    std::vector<OptArg> _deferred;
+    //! deferred callbacks are running, error() only collects
+    bool _deferring;
+
+    friend class ParseStream;
 };
 
 class OptionGroup : public OptionParser {
   public:
     OptionGroup(const OptionParser& p, const std::string& t, const std::string& d = "") :
-      _parser(p), _title(t), _group_description(d) {}
+      _parser(&p), _title(t), _group_description(d) {}
+    OptionGroup(const OptionGroup& other) = default;
+    OptionGroup(OptionGroup&& other) = default;
     virtual ~OptionGroup() {}
 
+    OptionGroup& operator=(const OptionGroup& other) = default;
+    OptionGroup& operator=(OptionGroup&& other) = default;
+
     OptionGroup& title(const std::string& t) { _title = t; return *this; }
     OptionGroup& group_description(const std::string& d) { _group_description = d; return *this; }
     const std::string& title() const { return _title; }
     const std::string& group_description() const { return _group_description; }
 
   private:
-    const OptionParser& _parser;
+    const OptionParser* _parser;
     std::string _title;
     std::string _group_description;
 };
 
 class Option {
   public:
-    Option() : _action("store"), _type("string"), _nargs(1), _callback(0) {}
+    //! What parse_args(Handler&) passes to on_value() for the type
+    enum ValueKind { STRING_VALUE, LONG_VALUE, DOUBLE_VALUE };
+
+    Option() : _action("store"), _action_id(0), _type("string"), _type_id(0), _nargs(1), _callback(0), _defer(false),
+      _dedupe(false), _unique_keys(false), _range_limit(65536) {}
     virtual ~Option() {}
 
     Option& action(const std::string& a);
-    Option& type(const std::string& t) { _type = t; return *this; }
+    Option& type(const std::string& t);
     Option& dest(const std::string& d) { _dest = d; return *this; }
     Option& set_default(const std::string& d) { _default = d; return *this; }
     template<typename T>
@@ -256,6 +561,27 @@ class Option {
     Option& help(const std::string& h) { _help = h; return *this; }
     Option& metavar(const std::string& m) { _metavar = m; return *this; }
     Option& callback(Callback& c) { _callback = &c; return *this; }
+    //! Any invocable taking the arguments of callbackFn, e.g. a lambda; it is
+    //! called without building any strings
+    Option& callback(const callbackFn& f) { _callback_fn = f; return *this; }
+    //! Queue the callback and run it when parsing is done; the calls of one
+    //! option keep their order, those of different options may run in
+    //! parallel (see OptionParser::callback_threads)
+    Option& defer(bool d) { _defer = d; return *this; }
+    //! The deferred callback waits until the deferred callbacks of opt
+    //! (e.g. "--dict") are done
+    Option& after(const std::string& opt) { _after.push_back(opt); return *this; }
+    //! append/append_const: skip values already appended to dest
+    Option& dedupe(bool d) { _dedupe = d; return *this; }
+    //! map: a NAME given again is an error (default: the last one wins)
+    Option& unique_keys(bool u) { _unique_keys = u; return *this; }
+    //! range_set: elements must be below n (default: 65536)
+    Option& range_limit(size_t n) { _range_limit = n; return *this; }
+    //! Build the object of the option type (e.g. a compiled std::regex) once
+    //! while parsing, Values::as() returns it; an invalid argument is
+    //! reported like for the built-in types, with the exception's what() or
+    //! "invalid value" as reason
+    Option& factory(const factoryFn& f) { _factory = f; return *this; }
 
     const std::string& action() const { return _action; }
     const std::string& type() const { return _type; }
@@ -267,9 +593,20 @@ class Option {
     const std::string& help() const { return _help; }
     const std::string& metavar() const { return _metavar; }
     Callback* callback() const { return _callback; }
+    bool defer() const { return _defer; }
+    const std::list<std::string>& after() const { return _after; }
+    bool dedupe() const { return _dedupe; }
+    bool unique_keys() const { return _unique_keys; }
+    size_t range_limit() const { return _range_limit; }
+    const factoryFn& factory() const { return _factory; }
 
   private:
-    std::string check_type(const std::string& opt, const std::string& val) const;
+    //! Error message if val is not valid for the type, "" otherwise; types
+    //! parsing into an object (see Values::as()) store it in obj if given
+    std::string check_type(const std::string& opt, const char* val, std::shared_ptr<void>* obj = 0) const;
+    const ActionInfo& action_info() const;
+    const TypeInfo& type_info() const;
+    ValueKind value_kind() const;
     std::string format_option_help(unsigned int indent = 2) const;
     std::string format_help(unsigned int indent = 2) const;
 
@@ -277,7 +614,9 @@ class Option {
     std::set<std::string> _long_opts;
 
     std::string _action;
+    size_t _action_id;
     std::string _type;
+    size_t _type_id;
     std::string _dest;
     std::string _default;
     size_t _nargs;
@@ -286,16 +625,175 @@ class Option {
     std::string _help;
     std::string _metavar;
     Callback* _callback;
+    callbackFn _callback_fn;
+    bool _defer;
+    std::list<std::string> _after;
+    bool _dedupe;
+    bool _unique_keys;
+    size_t _range_limit;
+    factoryFn _factory;
 
     friend class OptionParser;
+    friend class ParseStream;
 };
 
+//! "option OPT: REASON: 'VAL'", the message of an invalid argument
+std::string type_error(const std::string& opt, const std::string& reason, const char* val);
+
+//! Add the option type name, or replace the type of that name (like
+//! optparse's TYPE_CHECKER). Types are global and must be registered before
+//! any parsing starts.
+void register_type(const std::string& name, const typeChecker& check);
+//! Same for a type parsed into a T: convert(val, t) and, if given,
+//! validate(t) return 0, or the reason val is invalid (e.g. "invalid
+//! address"). Values::as<T>() returns the result.
+template<typename T>
+void register_type(const std::string& name, const std::function<const char* (const char*, T&)>& convert,
+    const std::function<const char* (const T&)>& validate = nullptr) {
+  register_type(name, [convert, validate](const Option&, const std::string& opt, const char* val,
+      std::shared_ptr<void>* obj) -> std::string {
+    std::shared_ptr<T> t = std::make_shared<T>();
+    const char* reason = convert(val, *t);
+    if (not reason and validate)
+      reason = validate(*t);
+    if (reason)
+      return type_error(opt, reason, val);
+    if (obj)
+      *obj = t;
+    return "";
+  });
+}
+//! Add the action name, or replace the action of that name (like extending
+//! optparse's Option.ACTIONS). Options with the action take nargs
+//! arguments unless Option::nargs() says otherwise; they are type checked
+//! first if typed is true, the parsed object is in ParseEvent::object.
+//! Actions are global and must be registered before options use them.
+void register_action(const std::string& name, size_t nargs, const actionFn& handle, bool typed = true);
+
 class Callback {
 public:
   virtual void operator() (const Option& option, const std::string& opt, const std::string& val, const OptionParser& parser) = 0;
   virtual ~Callback() {}
 };
 
+//! One step of a ParseStream
+class ParseEvent {
+  public:
+    enum Kind {
+      OPTION,     //!< option matched, with its argument if it takes one
+      POSITIONAL, //!< positional argument
+      UNKNOWN,    //!< unknown option, value is the rest of the argument
+                  //!< starting with it ("-" only if it started the argument)
+      INVALID     //!< ambiguous option, missing or malformed argument
+    };
+    ParseEvent() : kind(POSITIONAL), option(0), value(""), values(0), nvalues(0) {}
+
+    Kind kind;
+    const Option* option;
+    //! option as given, e.g. "-f" or "--fi"
+    std::string opt;
+    //! argument, points into the parsed arguments ("" if none); the first
+    //! one for options taking more
+    const char* value;
+    //! all arguments of the option, valid until the next event; a view
+    //! straight into argv where they are whole arguments in a row
+    const char* const* values;
+    size_t nvalues;
+    //! value parsed by the option type, if any (see Values::as())
+    std::shared_ptr<void> object;
+    std::string error;
+};
+
+//! Pull-style parser: yields one event per option or positional argument,
+//! in order, without storing anything in Values or args(). Actions are not
+//! carried out (not even help/version), but arguments are type checked.
+class ParseStream {
+  public:
+    //! [begin, end) must not include the program name
+    ParseStream(OptionParser& parser, char const* const* begin, char const* const* end);
+    //! Arguments stored one after the other, each followed by a NUL (the
+    //! program name not included)
+    ParseStream(OptionParser& parser, const char* buf, size_t len);
+
+    //! Fill in the next event, returns false at the end of the arguments
+    bool next(ParseEvent& ev);
+
+    //! Accept unambiguous abbreviations of long options (default: true)
+    ParseStream& allow_abbrev(bool a) { _allow_abbrev = a; return *this; }
+    bool allow_abbrev() const { return _allow_abbrev; }
+    //! Check arguments of type "file", "dir" and "path" against the file
+    //! system (default: true)
+    ParseStream& check_paths(bool c) { _check_paths = c; return *this; }
+    bool check_paths() const { return _check_paths; }
+    //! Add "did you mean" suggestions to the errors of unknown options, a
+    //! scan over all long options (default: true)
+    ParseStream& suggest(bool s) { _suggest = s; return *this; }
+    bool suggest() const { return _suggest; }
+    //! Only positional arguments follow
+    bool options_done() const { return _options_done and not _cluster; }
+    //! Consume and return the next argument unless it looks like an option
+    //! (or options are done); meant for the value of an unknown option
+    const char* take_value();
+
+  private:
+    bool at_end() const { return _buf ? _buf == _buf_end : _cur == _end; }
+    const char* take();
+    bool take_values(ParseEvent& ev, const char* first);
+    bool next_short(ParseEvent& ev);
+    bool next_long(ParseEvent& ev, const char* optstr);
+    bool check(ParseEvent& ev) const;
+    bool invalid(ParseEvent& ev, const std::string& msg) const;
+
+    const OptionParser& _parser;
+    char const* const* _cur;
+    char const* const* _end;
+    const char* _buf;
+    const char* _buf_end;
+    const char* _arg;
+    //! rest of a group of short options, e.g. "vf" after -x in -xvf
+    const char* _cluster;
+    //! long option name being looked up, reused between events
+    std::string _name;
+    //! arguments of options taking more than one, reused between events
+    std::vector<const char*> _values;
+    //! after "--", or after the first positional argument if interspersed
+    //! arguments are disabled
+    bool _options_done;
+    bool _allow_abbrev;
+    bool _check_paths;
+    bool _suggest;
+};
+
+template<typename Handler>
+void OptionParser::parse_args(Handler& handler, int argc, char const* const* argv) {
+  ParseStream stream(*this, &argv[1], &argv[argc]);
+  ParseEvent ev;
+  while (stream.next(ev)) {
+    if (ev.kind == ParseEvent::POSITIONAL) {
+      handler.on_positional(ev.value);
+    } else if (ev.kind == ParseEvent::UNKNOWN or ev.kind == ParseEvent::INVALID) {
+      handler.on_error(ev.error);
+    } else if (ev.option->nargs() == 0) {
+      handler.on_flag(*ev.option);
+    } else {
+      switch (ev.option->value_kind()) {
+      case Option::LONG_VALUE:
+        for (size_t i = 0; i < ev.nvalues; ++i)
+          handler.on_value(*ev.option, std::strtol(ev.values[i], 0, 10));
+        break;
+      case Option::DOUBLE_VALUE:
+        for (size_t i = 0; i < ev.nvalues; ++i)
+          handler.on_value(*ev.option, std::strtod(ev.values[i], 0));
+        break;
+      case Option::STRING_VALUE:
+        for (size_t i = 0; i < ev.nvalues; ++i)
+          handler.on_value(*ev.option, ev.values[i]);
+        break;
+      }
+    }
+  }
+}
+
 }
 
 #endif
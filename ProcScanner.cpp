@@ -0,0 +1,135 @@
+/**
+ * Copyright (C) 2010 Johannes Weißl <jargon@molb.org>
+ * License: your favourite BSD-style license
+ *
+ * See ProcScanner.h for help.
+ */
+
+#include "ProcScanner.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <dirent.h>
+
+using namespace std;
+
+namespace optparse {
+
+static bool read_cmdline(int pid, string& buf) {
+  ostringstream path;
+  path << "/proc/" << pid << "/cmdline";
+  ifstream f(path.str().c_str(), ios::binary);
+  if (not f)
+    return false;
+  buf.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+  if (buf.empty())
+    return false;
+  // processes rewriting their title may drop the final NUL
+  if (buf[buf.length()-1] != '\0')
+    buf += '\0';
+  return true;
+}
+
+static string prog_name(const char* argv0) {
+  const char* slash = strrchr(argv0, '/');
+  return slash ? slash + 1 : argv0;
+}
+
+static bool scan_process(OptionParser& parser, int pid, const string& prog, ProcessOptions& proc) {
+  shared_ptr<string> buf = make_shared<string>();
+  if (not read_cmdline(pid, *buf))
+    return false;
+  if (prog != "" and prog_name(buf->c_str()) != prog)
+    return false;
+
+  // parsed in place, the arguments are not copied
+  OptionParser p = parser.instance();
+  p.allow_exit(false);
+  proc.values = move(p.parse_known_args(buf->data(), buf->length()));
+  proc.pid = pid;
+  proc.prog = buf->c_str();
+  proc.cmdline = buf;
+  const list<string>& args = const_cast<const OptionParser&>(p).args();
+  proc.args.assign(args.begin(), args.end());
+  proc.unknown.assign(p.unknown_args().begin(), p.unknown_args().end());
+  proc.errors = p.errors();
+  return true;
+}
+
+static bool scan_failed(int pid, const string& what, ProcessOptions& proc) {
+  proc.pid = pid;
+  proc.errors.push_back(what);
+  return true;
+}
+
+static vector<ProcessOptions> scan(OptionParser& parser, const vector<int>& pids,
+    const string& prog, unsigned int threads) {
+  vector<ProcessOptions> procs(pids.size());
+  vector<char> found(pids.size(), 0);
+
+  // adds the help/version options now, so that the workers only read the
+  // shared option table
+  parser.instance();
+
+  if (threads == 0)
+    threads = max(thread::hardware_concurrency(), 1u);
+  threads = (unsigned int) min<size_t>(threads, pids.size());
+
+  atomic<size_t> next(0);
+  vector<thread> workers;
+  for (unsigned int t = 0; t < threads; ++t) {
+    workers.push_back(thread([&]() {
+      for (size_t i = next++; i < pids.size(); i = next++) {
+        // a throwing callback must not take the other processes down
+        try {
+          found[i] = scan_process(parser, pids[i], prog, procs[i]);
+        } catch (const exception& e) {
+          found[i] = scan_failed(pids[i], e.what(), procs[i]);
+        } catch (...) {
+          found[i] = scan_failed(pids[i], "unknown exception", procs[i]);
+        }
+      }
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+
+  vector<ProcessOptions> result;
+  for (size_t i = 0; i < procs.size(); ++i) {
+    if (found[i])
+      result.push_back(move(procs[i]));
+  }
+  return result;
+}
+
+vector<int> list_processes() {
+  vector<int> pids;
+  DIR* dir = opendir("/proc");
+  if (not dir)
+    return pids;
+  while (struct dirent* e = readdir(dir)) {
+    char* end;
+    long pid = strtol(e->d_name, &end, 10);
+    if (*end == '\0' and pid > 0)
+      pids.push_back((int) pid);
+  }
+  closedir(dir);
+  sort(pids.begin(), pids.end());
+  return pids;
+}
+
+vector<ProcessOptions> scan_processes(OptionParser& parser, const vector<int>& pids,
+    unsigned int threads /* = 0 */) {
+  return scan(parser, pids, "", threads);
+}
+vector<ProcessOptions> scan_processes(OptionParser& parser, const string& prog /* = "" */,
+    unsigned int threads /* = 0 */) {
+  return scan(parser, list_processes(), prog, threads);
+}
+
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2010 Johannes Weißl <jargon@molb.org>
+ * License: your favourite BSD-style license
+ *
+ * Parse the command lines of running processes (Linux, /proc/<pid>/cmdline)
+ * against an OptionParser, e.g. to audit which options services run with.
+ *
+ * Example:
+ *
+ * optparse::OptionParser parser;
+ * parser.add_option("-p", "--port") .type("int") .set_default(80);
+ *
+ * std::vector<optparse::ProcessOptions> procs = optparse::scan_processes(parser, "httpd");
+ * for (size_t i = 0; i < procs.size(); ++i)
+ *     cout << procs[i].pid << ": " << procs[i].values["port"] << endl;
+ */
+
+#ifndef PROCSCANNER_H_
+#define PROCSCANNER_H_
+
+#include "OptionParser.h"
+
+#include <string>
+#include <vector>
+#include <list>
+
+namespace optparse {
+
+//! Effective options of one process
+class ProcessOptions {
+  public:
+    ProcessOptions() : pid(0) {}
+
+    int pid;
+    std::string prog;
+    Values values;
+    std::vector<std::string> args;
+    //! unknown options, see OptionParser::unknown_args()
+    std::vector<std::string> unknown;
+    //! parse errors, or what() of an exception thrown while parsing
+    std::list<std::string> errors;
+    //! the NUL-separated command line, Values::argv() points into it
+    std::shared_ptr<const std::string> cmdline;
+};
+
+//! Pids of all running processes, in ascending order
+std::vector<int> list_processes();
+
+//! Parse the command line of each of the given processes with
+//! parser.parse_known_args(), on up to threads threads (0: one per CPU).
+//! Every process gets its own parser.instance() with allow_exit(false), so
+//! callback actions run concurrently; an exception thrown by one ends up
+//! in that process' errors. Processes that have exited or have no command
+//! line (kernel threads) are left out.
+std::vector<ProcessOptions> scan_processes(OptionParser& parser, const std::vector<int>& pids,
+    unsigned int threads = 0);
+//! Same for all processes whose program name (basename of argv[0]) is
+//! prog, or all processes if prog is empty
+std::vector<ProcessOptions> scan_processes(OptionParser& parser, const std::string& prog = "",
+    unsigned int threads = 0);
+
+}
+
+#endif
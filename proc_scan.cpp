@@ -0,0 +1,51 @@
+#include "ProcScanner.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+using namespace optparse;
+
+// Lists the options all running instances of a program were started with,
+// as seen through a (here: made up) option schema of that program.
+int main(int argc, char *argv[])
+{
+  OptionParser parser = OptionParser()
+    .usage("%prog [options] PROGRAM")
+    .description("Show the effective options of all running instances of PROGRAM.");
+  parser.add_option("-j", "--threads") .type("int") .set_default(0)
+    .help("scanner threads (default: one per CPU)");
+
+  Values& options = parser.parse_args(argc, argv);
+  if (parser.args().size() != 1) {
+    parser.print_help();
+    return 2;
+  }
+
+  OptionParser schema;
+  schema.add_option("-c", "--config") .metavar("FILE");
+  schema.add_option("-p", "--port") .type("int") .set_default(80);
+  schema.add_option("-v", "--verbose") .action("count");
+  schema.add_option("-D", "--define") .action("append");
+
+  vector<ProcessOptions> procs = scan_processes(schema, parser.args().front(),
+      (unsigned int) options.get("threads"));
+
+  for (vector<ProcessOptions>::const_iterator it = procs.begin(); it != procs.end(); ++it) {
+    ArgvBuffer effective;
+    schema.to_argv(effective, it->values);
+    cout << it->pid << " " << it->prog << ":";
+    for (size_t i = 0; i < effective.size(); ++i)
+      cout << " " << effective[i];
+    cout << endl;
+    cout << "  port: " << it->values["port"] << endl;
+    for (vector<string>::const_iterator uit = it->unknown.begin(); uit != it->unknown.end(); ++uit)
+      cout << "  unknown: " << *uit << endl;
+    for (list<string>::const_iterator eit = it->errors.begin(); eit != it->errors.end(); ++eit)
+      cout << "  error: " << *eit << endl;
+  }
+
+  return 0;
+}
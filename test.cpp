@@ -21,7 +21,7 @@ public:
     cout << s;
   }
   ~Output() { cout << endl; }
-  const string& delim;
+  const string delim;
   bool first;
 };
 
@@ -104,6 +104,10 @@ int main(int argc, char *argv[])
   parser.add_option("-m", "--more") .action("append");
   parser.add_option("--more-milk") .action("append_const") .set_const("milk");
   parser.add_option("--hidden") .help(SUPPRESS_HELP);
+  parser.add_option("-p", "--point") .nargs(2) .type("float") .metavar("X") .help("two coordinates");
+  parser.add_option("-D", "--define") .action("map") .metavar("NAME=VALUE") .help("define NAME (repeatable)");
+  parser.add_option("--buffer") .type("size") .set_default("64K") .help("buffer size (default: %default)");
+  parser.add_option("--timeout") .type("duration") .set_default("1.5s") .help("timeout (default: %default)");
 
   MyCallback mc;
   parser.add_option("-K", "--callback") .action("callback") .callback(mc) .help("callback test");
@@ -142,8 +146,44 @@ int main(int argc, char *argv[])
       out(*it);
   }
   cout << "hidden: " << options["hidden"] << endl;
+  cout << "point: ";
+  for_each(options.argv("point").begin(), options.argv("point").end(), Output(", "));
+  cout << "define: ";
+  {
+    vector<string> defs;
+    const refMap* m = options.as<refMap>("define");
+    for (refMap::const_iterator it = m ? m->begin() : refMap::const_iterator(); m and it != m->end(); ++it)
+      defs.push_back(it->first.str() + "=" + it->second);
+    sort(defs.begin(), defs.end());
+    for_each(defs.begin(), defs.end(), Output(", "));
+  }
+  cout << "buffer: " << *options.as<uint64_t>("buffer") << endl;
+  cout << "timeout: " << *options.as<uint64_t>("timeout") << endl;
   cout << "group: " << (options.get("g") ? "true" : "false") << endl;
 
+  ArgvBuffer forward;
+  parser.to_argv(forward, options);
+  cout << "to_argv: ";
+  {
+    Output out(" ");
+    for (size_t i = 0; i < forward.size(); ++i)
+      out(forward[i]);
+  }
+
+  cout << "constraints: ";
+  {
+    // constraints added while an instance shares the schema
+    OptionParser cp = OptionParser().prog("cprog");
+    cp.add_option("--x");
+    cp.add_option("--y");
+    cp.add_option("--z");
+    OptionParser shared = cp.instance();
+    cp.required("--x").depends("--y", "--x").mutually_exclusive("--y", "--z").at_least_one_of("--y", "--z");
+    const char* const cargs[] = { "cprog", "--x", "1", "--y", "2" };
+    Values& cv = cp.parse_args(&cargs[0], &cargs[5]);
+    cout << cv["x"] << " " << cv["y"] << endl;
+  }
+
   cout << endl << "leftover arguments: " << endl;
   for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
     cout << "arg: " << *it << endl;